@@ -4,10 +4,43 @@
 #include <webgpu/webgpu.h>
 #include <stdio.h>
 #include <math.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <mutex>
 #include <memory>
-#include <functional>
+#include <new>
+#include <type_traits>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Jobs run on worker threads natively and in builds with -pthread (LOCALFILE2_THREADS in
+// CMakeLists.txt), otherwise on the main thread
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define JOBS_THREADED 1
+#include <thread>
+#include <condition_variable>
+#else
+#define JOBS_THREADED 0
+#endif
 
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/glm.hpp>
@@ -16,6 +49,13 @@
 
 #include <imgui.h>
 
+#define STB_TRUETYPE_IMPLEMENTATION
+#define STBTT_STATIC
+#include <imstb_truetype.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../3rdparty/stb/stb_image.h"
+
 // the imgui default
 static_assert(sizeof(ImDrawVert) == 20);
 // switched to uint in imconfig.h
@@ -37,10 +77,44 @@ inline bool operator!=(const Size &a, const Size &b)
     return !(a == b);
 }
 
+// Callable that never allocates: a trampoline plus the captures stored inline. Captures must
+// fit in Capacity bytes and be trivially copyable (pointers, handles, numbers), anything else
+// goes in a heap object whose pointer is captured instead.
+template<typename Signature, size_t Capacity = 32>
+class Delegate;
+
+template<typename R, typename... Args, size_t Capacity>
+class Delegate<R(Args...), Capacity>
+{
+public:
+    Delegate() = default;
+    Delegate(std::nullptr_t) { }
+    template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Delegate>::value>>
+    Delegate(F f)
+    {
+        static_assert(sizeof(F) <= Capacity, "Delegate capture too large");
+        static_assert(alignof(F) <= alignof(std::max_align_t), "Delegate capture over-aligned");
+        static_assert(std::is_trivially_copyable<F>::value && std::is_trivially_destructible<F>::value,
+                      "Delegate captures must be trivially copyable");
+        new (storage) F(f);
+        invoke = [](void *storage, Args... args) -> R {
+            return (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+        };
+    }
+
+    R operator()(Args... args) const { return invoke(storage, std::forward<Args>(args)...); }
+    explicit operator bool() const { return invoke != nullptr; }
+
+private:
+    R (*invoke)(void *, Args...) = nullptr;
+    alignas(std::max_align_t) mutable unsigned char storage[Capacity];
+};
+
 struct SceneData;
 
 struct Scene
 {
+    void start_loading(); // before the device exists
     void init();
     void cleanup();
     void gui();
@@ -51,8 +125,681 @@ struct Scene
 
 static const uint32_t MAX_UBUF_SIZE = 65536;
 
-using LocalFileLoadCallback = std::function<void(const char *filename, const char *mime_type, char *data, size_t size)>;
-using LocalFileLoadFsApiCallback = std::function<void(const char *filename, char *data, size_t size)>;
+// Logs every shader module, render pipeline and attachment creation, the Scene window shows the totals
+static const bool LOG_GPU_OBJECT_CREATION = false;
+
+// Nothing uses stencil, so the depth attachment is depth-only (smaller, and both aspects
+// would be discarded after the pass anyway). Pipelines and bundles must use the same format.
+static const bool DEPTH_ATTACHMENT_STENCIL = false;
+static const WGPUTextureFormat DEPTH_FORMAT = DEPTH_ATTACHMENT_STENCIL ? WGPUTextureFormat_Depth24PlusStencil8 : WGPUTextureFormat_Depth24Plus;
+
+// Render attachments come from a pool keyed by format and size. While the window is being
+// resized the scene renders into a rounded up color/depth pair with the viewport set to
+// fb_size and gets blitted to the swapchain, so a drag only allocates when crossing a bucket
+// boundary. Once the size has settled, rendering goes straight to the swapchain again with
+// an exact size depth attachment, and textures unused for a while are released.
+static const uint32_t ATTACHMENT_SIZE_BUCKET = 256;
+static const uint32_t RESIZE_SETTLE_FRAMES = 30;
+static const uint32_t ATTACHMENT_MAX_IDLE_FRAMES = 60;
+
+// Small buffers are sub-allocated from GPU_HEAP_BLOCK_SIZE blocks, one set of blocks per
+// kind of usage. Free ranges are kept in power of two size classes and merged with free
+// neighbours, an allocation takes a range from the first non-empty class that is certain
+// to fit. Larger allocations get a dedicated buffer.
+static const uint64_t GPU_HEAP_BLOCK_SIZE = 4 * 1024 * 1024;
+static const uint64_t GPU_HEAP_MAX_SUBALLOCATION = GPU_HEAP_BLOCK_SIZE / 4;
+static const int GPU_HEAP_SIZE_CLASSES = 23; // the largest holds whole blocks
+
+enum class GpuHeapKind
+{
+    Vertex,
+    Index,
+    Uniform,
+    Storage,
+    Count
+};
+
+// Release through a GpuHandle (or defer_release()), the range is reused once the GPU is done with it
+struct GpuHeapAllocation
+{
+    WGPUBuffer buffer = nullptr;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    GpuHeapKind kind;
+    int block = -1; // -1 for a dedicated buffer
+};
+
+struct GpuHeapBlock
+{
+    WGPUBuffer buffer = nullptr;
+    std::map<uint64_t, uint64_t> free_ranges; // offset -> size
+};
+
+struct GpuHeap
+{
+    std::vector<GpuHeapBlock> blocks;
+    std::set<std::pair<int, uint64_t>> size_classes[GPU_HEAP_SIZE_CLASSES]; // (block, offset) of free ranges
+    uint32_t allocation_count = 0;
+    uint64_t allocated_bytes = 0;
+    uint32_t dedicated_count = 0;
+    uint64_t dedicated_bytes = 0;
+};
+
+// Transient allocations that live until the end of the frame: a bump pointer into chunks
+// that are kept across frames, reset by end_frame(). Once warmed up, per-frame data does
+// not touch (and cannot fragment) the general heap. Nothing is destructed, so only use it
+// for trivially destructible data or containers with FrameAllocator.
+static const size_t FRAME_ARENA_CHUNK_SIZE = 1024 * 1024;
+
+struct FrameArena
+{
+    struct Chunk
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Chunk> chunks;
+    size_t chunk = 0; // the one being filled
+    size_t used = 0; // in that chunk
+    size_t frame_bytes = 0;
+    size_t peak_frame_bytes = 0;
+};
+
+// mallinfo() samples over the lifetime of the app, for spotting growth or fragmentation
+// over long sessions
+static const double HEAP_SAMPLE_INTERVAL_MS = 60000.0;
+static const int HEAP_SAMPLE_COUNT = 480; // 8 hours
+
+struct HeapStats
+{
+    double last_sample_time = 0.0;
+    int sample_count = 0; // total, the ring holds the last HEAP_SAMPLE_COUNT
+    float in_use_mb[HEAP_SAMPLE_COUNT];
+    float free_mb[HEAP_SAMPLE_COUNT];
+};
+
+// Every buffer and texture creation wrapper registers the object with its byte size and
+// category, release_now() unregisters it. Whatever is still registered at cleanup() leaked.
+// When the total goes over the budget, the registered evictors are asked to free memory
+// (e.g. by dropping idle attachments or downscaling textures), one step at a time.
+enum class GpuMemoryCategory
+{
+    Buffers,
+    Staging,
+    Textures,
+    FontAtlas,
+    Attachments,
+    Count
+};
+
+static const char *gpu_memory_category_names[] = { "Buffers", "Staging", "Textures", "Font atlas", "Attachments" };
+
+static const uint32_t GPU_MEMORY_EVICT_INTERVAL_FRAMES = 10; // releases take a few frames to happen
+
+// Returns true when it gave up something
+using GpuMemoryEvictCallback = Delegate<bool()>;
+
+struct GpuMemoryTracker
+{
+    struct Category
+    {
+        uint64_t bytes = 0;
+        uint64_t peak_bytes = 0;
+        uint32_t count = 0;
+    };
+    struct Object
+    {
+        GpuMemoryCategory category;
+        uint64_t bytes;
+    };
+    struct Evictor
+    {
+        const void *owner;
+        GpuMemoryEvictCallback evict;
+    };
+    Category categories[int(GpuMemoryCategory::Count)];
+    uint64_t total_bytes = 0;
+    uint64_t peak_bytes = 0;
+    std::unordered_map<const void *, Object> objects;
+    float budget_mb = 256.0f;
+    std::vector<Evictor> evictors;
+    uint32_t last_evict_frame = 0;
+    uint32_t eviction_count = 0;
+};
+
+// Objects given up in frame N (frame_count) are released once the GPU has completed the
+// work submitted in that frame, as reported by wgpuQueueOnSubmittedWorkDone()
+struct DeferredRelease
+{
+    uint32_t frame;
+    void (*release)(void *obj);
+    void *obj;
+};
+
+template<typename T>
+static void defer_release(T obj);
+
+// Owns one reference to a WebGPU object, released through defer_release() when the
+// handle is destroyed or assigned another object. Converts to the plain handle.
+template<typename T>
+class GpuHandle
+{
+public:
+    GpuHandle() = default;
+    GpuHandle(T obj) : obj(obj) { }
+    GpuHandle(GpuHandle &&other) : obj(other.obj) { other.obj = nullptr; }
+    GpuHandle(const GpuHandle &) = delete;
+    ~GpuHandle() { defer_release(obj); }
+
+    GpuHandle &operator=(GpuHandle &&other)
+    {
+        if (this != &other) {
+            reset(other.obj);
+            other.obj = nullptr;
+        }
+        return *this;
+    }
+    GpuHandle &operator=(const GpuHandle &) = delete;
+    GpuHandle &operator=(T new_obj)
+    {
+        reset(new_obj);
+        return *this;
+    }
+
+    void reset(T new_obj = nullptr)
+    {
+        if (new_obj != obj)
+            defer_release(obj);
+        obj = new_obj;
+    }
+    T get() const { return obj; }
+    operator T() const { return obj; }
+    T operator->() const { return obj; }
+    // for descriptors that take an array of handles
+    const T *ptr() const { return &obj; }
+
+private:
+    T obj = nullptr;
+};
+
+struct PooledAttachment
+{
+    GpuHandle<WGPUTexture> texture;
+    GpuHandle<WGPUTextureView> view;
+    WGPUTextureFormat format;
+    Size size;
+    uint32_t last_used_frame = 0;
+};
+
+// The GUI font atlas holds signed distance fields baked at SDF_SIZE pixels, so the same
+// atlas serves any font scale or device pixel ratio. 0.5 (SDF_ON_EDGE) is the glyph outline,
+// the field falls off over SDF_PADDING pixels on both sides.
+static const float GUI_FONT_SDF_SIZE = 32.0f;
+static const int GUI_FONT_SDF_PADDING = 4;
+static const unsigned char GUI_FONT_SDF_ON_EDGE = 128;
+static const float GUI_FONT_SIZE = 20.0f;
+
+// Glyphs beyond the baked Latin-1 range are rasterized on first use into a region
+// reserved in the font atlas, in fixed size cells recycled in least recently used order.
+struct GuiGlyphCache
+{
+    static const int REGION_WIDTH = 960;
+    static const int REGION_HEIGHT = 480;
+    static const int MAX_RASTERIZE_PER_FRAME = 32;
+
+    struct Cell
+    {
+        ImWchar codepoint = 0;
+        uint32_t last_used = 0;
+    };
+
+    ImFont *font = nullptr;
+    stbtt_fontinfo font_info;
+    float scale = 1.0f;
+    int region_rect_id = -1;
+    int region_x = 0;
+    int region_y = 0;
+    int cell_size = 0;
+    int columns = 0;
+    std::vector<Cell> cells;
+    std::unordered_map<ImWchar, int> resident;
+    std::vector<ImWchar> missing;
+    std::unordered_set<ImWchar> requested;
+    std::unordered_set<ImWchar> unavailable;
+    uint32_t frame = 0;
+    uint32_t rasterized_count = 0;
+    uint32_t evicted_count = 0;
+};
+
+// Font file bytes, kept for the lifetime of the app so that atlases (and the glyph cache)
+// can be rebuilt from them at any time without opening the file again. Files are mapped
+// where that works; natively this shares the page cache, on Emscripten's MEMFS mmap()
+// allocates and copies, which is no worse than reading the file.
+struct FontSource
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::unique_ptr<unsigned char[]> owned;
+};
+
+// Receives a new reference, or null when creation failed
+using RenderPipelineReadyCallback = Delegate<void(WGPURenderPipeline)>;
+
+struct RenderPipelineCacheEntry
+{
+    GpuHandle<WGPURenderPipeline> ps;
+    bool pending = false; // asynchronous creation in flight
+    std::vector<RenderPipelineReadyCallback> waiters;
+};
+
+// Times are ms since navigation start, so they include downloading and compiling the wasm
+// before main(). Milestones are only recorded on the main thread.
+struct StartupMilestone
+{
+    const char *name;
+    double ms;
+};
+
+// Async completions (file pickers, pipeline compilation, buffer mapping, queue work done) are
+// queued and run at the start of the next frame instead of inside the JS promise handler or
+// wgpu callback that reported them
+using Completion = Delegate<void()>;
+
+static const uint32_t COMPLETION_QUEUE_SIZE = 1024; // power of two
+static const float COMPLETION_BUDGET_MS = 2.0f;
+
+// Lock-free multi-producer single-consumer ring with a sequence number per slot (Dmitry
+// Vyukov's bounded queue): any thread may post, only the main loop runs completions.
+// Posting never allocates, a full ring spills into a locked overflow list. Once it has
+// spilled, everything goes to the overflow until that is drained, so that posting order holds.
+struct CompletionQueue
+{
+    struct Slot
+    {
+        std::atomic<uint32_t> sequence;
+        Completion completion;
+    };
+    Slot slots[COMPLETION_QUEUE_SIZE];
+    std::atomic<uint32_t> enqueue_pos { 0 };
+    uint32_t dequeue_pos = 0;
+    std::mutex overflow_mutex;
+    std::vector<Completion> overflow;
+    std::atomic<bool> overflowing { false }; // set and cleared with overflow_mutex held
+    std::vector<Completion> spilled; // consumer only, taken from overflow, run before it
+    size_t spilled_pos = 0;
+
+    CompletionQueue()
+    {
+        for (uint32_t i = 0; i < COMPLETION_QUEUE_SIZE; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(const Completion &c)
+    {
+        uint32_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot &slot(slots[pos & (COMPLETION_QUEUE_SIZE - 1)]);
+            const int32_t diff = int32_t(slot.sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.completion = c;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer only. Fails when empty, or when the next slot is claimed but not written yet.
+    bool try_pop(Completion *c)
+    {
+        Slot &slot(slots[dequeue_pos & (COMPLETION_QUEUE_SIZE - 1)]);
+        if (int32_t(slot.sequence.load(std::memory_order_acquire) - (dequeue_pos + 1)) < 0)
+            return false;
+        *c = slot.completion;
+        slot.sequence.store(dequeue_pos + COMPLETION_QUEUE_SIZE, std::memory_order_release);
+        ++dequeue_pos;
+        return true;
+    }
+
+    uint32_t size() const
+    {
+        return enqueue_pos.load(std::memory_order_acquire) - dequeue_pos;
+    }
+
+    // Consumer only, drops whatever has not run yet
+    void clear()
+    {
+        Completion c;
+        while (try_pop(&c)) {
+        }
+        std::lock_guard<std::mutex> lock(overflow_mutex);
+        overflow.clear();
+        spilled.clear();
+        spilled_pos = 0;
+        overflowing.store(false, std::memory_order_release);
+    }
+};
+
+using Job = Delegate<void()>;
+
+static const uint32_t MAX_JOB_THREADS = 16; // including the main thread
+
+// Jobs pushed with a counter increment it, it drops back to zero when they have all run
+struct JobCounter
+{
+    std::atomic<uint32_t> pending { 0 };
+};
+
+// One deque per thread, index 0 belongs to the main thread. Threads push and pop their
+// own jobs at the back (the most recent, still in cache) and steal from the front of the
+// others' (the oldest, usually the largest remaining piece of work). Waiting for a counter
+// runs jobs meanwhile instead of blocking, which the browser main thread cannot do anyway.
+struct JobSystem
+{
+    struct QueuedJob
+    {
+        Job job;
+        JobCounter *counter;
+    };
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<QueuedJob> jobs;
+        std::atomic<uint32_t> run { 0 };
+        std::atomic<uint32_t> stolen { 0 };
+    };
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<uint32_t> queued { 0 };
+#if JOBS_THREADED
+    std::vector<std::thread> threads;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<bool> quit { false }; // stored with sleep_mutex held so that no wakeup is lost
+#endif
+    static thread_local uint32_t thread_index;
+
+    ~JobSystem() { stop(); }
+
+    uint32_t thread_count() const { return std::max<uint32_t>(1, uint32_t(queues.size())); }
+
+    void start(uint32_t worker_count)
+    {
+#if !JOBS_THREADED
+        worker_count = 0;
+#endif
+        for (uint32_t i = 0; i <= worker_count; ++i)
+            queues.emplace_back(new Queue);
+#if JOBS_THREADED
+        for (uint32_t i = 1; i <= worker_count; ++i) {
+            threads.emplace_back([this, i] {
+                thread_index = i;
+                worker_main();
+            });
+        }
+#endif
+    }
+
+    // Jobs already running finish, queued ones are dropped without running
+    void stop()
+    {
+#if JOBS_THREADED
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            quit.store(true, std::memory_order_relaxed);
+        }
+        wake.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+        threads.clear();
+#endif
+        queues.clear();
+        queued.store(0, std::memory_order_relaxed);
+    }
+
+    void push(JobCounter *counter, const Job &job)
+    {
+        if (counter)
+            counter->pending.fetch_add(1, std::memory_order_relaxed);
+        Queue &q(*queues[thread_index]);
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.jobs.push_back({ job, counter });
+        }
+        queued.fetch_add(1, std::memory_order_release);
+#if JOBS_THREADED
+        {
+            // pairs with the predicate check in worker_main(), so that the wakeup is not lost
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_one();
+#endif
+    }
+
+    bool try_run_one()
+    {
+        const uint32_t n = uint32_t(queues.size());
+        QueuedJob job;
+        bool found = false;
+        {
+            Queue &own(*queues[thread_index]);
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.jobs.empty()) {
+                job = own.jobs.back();
+                own.jobs.pop_back();
+                found = true;
+            }
+        }
+        for (uint32_t i = 1; i < n && !found; ++i) {
+            Queue &victim(*queues[(thread_index + i) % n]);
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                queues[thread_index]->stolen.fetch_add(1, std::memory_order_relaxed);
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        job.job();
+        queues[thread_index]->run.fetch_add(1, std::memory_order_relaxed);
+        if (job.counter)
+            job.counter->pending.fetch_sub(1, std::memory_order_release);
+        return true;
+    }
+
+    void wait(JobCounter *counter)
+    {
+        while (counter->pending.load(std::memory_order_acquire)) {
+            if (!try_run_one()) {
+#if JOBS_THREADED
+                std::this_thread::yield();
+#endif
+            }
+        }
+    }
+
+#if JOBS_THREADED
+    void worker_main()
+    {
+        while (!quit.load(std::memory_order_relaxed)) {
+            if (try_run_one())
+                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return quit.load(std::memory_order_relaxed) || queued.load(std::memory_order_acquire); });
+        }
+    }
+#endif
+};
+
+thread_local uint32_t JobSystem::thread_index = 0;
+
+// What run_job_async() was given, owned by d.async_jobs until the continuation has run, so
+// that the ones dropped at exit (queued jobs, completions not run yet) can be freed
+struct AsyncJob
+{
+    Job work;
+    Completion then;
+};
+
+enum class InputEventType : uint8_t
+{
+    MouseMove,
+    MouseButton,
+    Wheel,
+    Key,
+    Char
+};
+
+enum InputModifier : uint8_t
+{
+    INPUT_MOD_CTRL = 1,
+    INPUT_MOD_SHIFT = 2,
+    INPUT_MOD_ALT = 4,
+    INPUT_MOD_SUPER = 8
+};
+
+// What the GUI needs from a DOM input event
+struct InputEvent
+{
+    double time; // emscripten_get_now() when the callback got it
+    InputEventType type;
+    uint8_t mods;
+    bool down;
+    int8_t button; // ImGui numbering, -1 when only the modifiers changed
+    float x; // mouse position or wheel delta
+    float y;
+    ImGuiKey key;
+    char text[8]; // UTF-8, for Char
+};
+
+static const uint32_t INPUT_RING_SIZE = 256; // power of two
+static const int INPUT_LATENCY_SAMPLE_COUNT = 120;
+static const uint32_t INPUT_INFLIGHT_FRAMES = 16;
+
+// Single producer (the DOM event callbacks) single consumer (next_gui_frame()) ring. Both run
+// on the main thread, the ring only decouples when events arrive from when ImGui sees them.
+// When the ring is full (no frame for a long time) events spill into a locked list, where a
+// mouse move or wheel event is merged into the one before it when that has the same type.
+// Once spilled, everything goes there until the consumer has taken it, so nothing is lost
+// or reordered: button and key transitions all arrive, only the in-between positions don't.
+struct InputRing
+{
+    InputEvent events[INPUT_RING_SIZE];
+    std::atomic<uint32_t> head { 0 };
+    std::atomic<uint32_t> tail { 0 };
+    std::atomic<uint32_t> pushed { 0 };
+    std::atomic<uint32_t> merged { 0 };
+    std::mutex spill_mutex;
+    std::vector<InputEvent> spill;
+    std::atomic<bool> spilling { false }; // set and cleared with spill_mutex held
+    std::vector<InputEvent> taken; // consumer only, taken from spill, popped before the ring
+    size_t taken_pos = 0;
+
+    void push(const InputEvent &e)
+    {
+        pushed.fetch_add(1, std::memory_order_relaxed);
+        if (!spilling.load(std::memory_order_acquire)) {
+            const uint32_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) < INPUT_RING_SIZE) {
+                events[h & (INPUT_RING_SIZE - 1)] = e;
+                head.store(h + 1, std::memory_order_release);
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> lock(spill_mutex);
+        spilling.store(true, std::memory_order_release);
+        if (!spill.empty() && spill.back().type == e.type) {
+            // the time stays that of the first one
+            InputEvent &last(spill.back());
+            if (e.type == InputEventType::MouseMove) {
+                last.x = e.x;
+                last.y = e.y;
+                merged.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (e.type == InputEventType::Wheel) {
+                last.x += e.x;
+                last.y += e.y;
+                merged.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        spill.push_back(e);
+    }
+
+    bool pop(InputEvent *e)
+    {
+        if (taken_pos < taken.size()) {
+            *e = taken[taken_pos++];
+            return true;
+        }
+        const uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            if (!spilling.load(std::memory_order_acquire))
+                return false;
+            std::lock_guard<std::mutex> lock(spill_mutex);
+            // events that made it into the ring before the spill started go first
+            if (t == head.load(std::memory_order_acquire)) {
+                taken.clear();
+                taken.swap(spill);
+                taken_pos = 0;
+                spilling.store(false, std::memory_order_release);
+                if (taken.empty())
+                    return false;
+                *e = taken[taken_pos++];
+                return true;
+            }
+        }
+        *e = events[t & (INPUT_RING_SIZE - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Latency from the oldest input event a frame consumed to the frame's submit, and to the
+// GPU having finished it (wgpuQueueOnSubmittedWorkDone), the closest this gets to photons:
+// presenting adds up to one more display refresh. Event times are taken when the callback
+// runs, so the browser's own dispatch delay is not included.
+struct InputStats
+{
+    uint32_t mods = 0; // as last given to ImGui
+    uint32_t applied = 0; // events given to ImGui after coalescing
+    uint32_t last_frame_raw = 0;
+    uint32_t last_frame_applied = 0;
+    struct
+    {
+        uint32_t frame;
+        double input_time;
+        double submit_ms;
+    } inflight[INPUT_INFLIGHT_FRAMES] = {};
+    double frame_input_time = 0.0; // oldest event drained this frame, 0 when none
+    int sample_count = 0; // total, the ring holds the last INPUT_LATENCY_SAMPLE_COUNT
+    float submit_ms[INPUT_LATENCY_SAMPLE_COUNT];
+    float gpu_done_ms[INPUT_LATENCY_SAMPLE_COUNT];
+};
+
+struct CompletionStats
+{
+    uint64_t run = 0;
+    uint32_t last_frame_run = 0;
+    uint32_t max_frame_run = 0;
+    uint32_t carried_over = 0; // left for the next frame by the budget
+    uint32_t overflows = 0; // run from the overflow list
+    float last_drain_ms = 0.0f;
+    float max_drain_ms = 0.0f;
+};
+
+using LocalFileLoadCallback = Delegate<void(const char *filename, const char *mime_type, char *data, size_t size)>;
+using LocalFileLoadFsApiCallback = Delegate<void(const char *filename, char *data, size_t size)>;
+using LocalFileSaveFsApiCallback = Delegate<void(bool ok)>;
 
 struct
 {
@@ -65,16 +812,69 @@ struct
     WGPUQueue queue = nullptr;
     WGPUSurface surface = nullptr;
     WGPUSwapChain swapchain = nullptr;
-    WGPUTextureView backbuffer = nullptr;
+    GpuHandle<WGPUTextureView> backbuffer;
 
+    bool size_dirty = false; // resize events since the last frame
+    uint32_t frame_count = 0;
+    Size last_frame_fb_size;
+    uint32_t last_resize_frame = 0;
+    Size render_size; // the part of the attachments the scene renders to
     Size attachments_size;
-    WGPUTexture ds = nullptr;
+    WGPUTextureView color_target_view = nullptr; // offscreen, null when rendering to the backbuffer
     WGPUTextureView ds_view = nullptr;
+    std::vector<PooledAttachment> attachment_pool;
+    struct {
+        uint32_t allocations = 0;
+        uint64_t allocated_bytes = 0; // total over the lifetime of the app
+        uint64_t pooled_bytes = 0;
+    } attachment_stats;
+    GpuHandle<WGPUBindGroupLayout> blit_bgl;
+    GpuHandle<WGPUPipelineLayout> blit_pl;
+    GpuHandle<WGPURenderPipeline> blit_ps;
+    GpuHandle<WGPUBindGroup> blit_bg;
+    WGPUTextureView blit_bg_view = nullptr;
+    GpuHandle<WGPUSampler> blit_sampler;
+    GpuHandle<WGPUBuffer> blit_ubuf;
+    Size blit_ubuf_render_size;
+    Size blit_ubuf_fb_size;
+
+    // The scene renders at fb_size * scale, adjusted based on the measured frame time, and
+    // is upscaled by the blit. The GUI is drawn in the blit pass, at full resolution.
+    struct {
+        bool enabled = false;
+        float scale = 1.0f;
+        float target_ms = 1000.0f / 60.0f;
+        double last_frame_time = 0.0;
+        double avg_frame_ms = 0.0;
+        uint32_t frames_since_change = 0;
+    } dynamic_resolution;
 
     WGPUCommandEncoder res_encoder = nullptr;
     WGPUCommandEncoder render_encoder = nullptr;
+    std::vector<DeferredRelease> deferred_releases;
+    uint32_t completed_frame = 0; // the last frame the GPU has finished
+    GpuHeap gpu_heaps[int(GpuHeapKind::Count)];
+    GpuMemoryTracker gpu_memory;
+    FrameArena frame_arena;
+    HeapStats heap_stats;
     std::vector<WGPUBuffer> free_ubuf_staging_buffers;
     std::vector<WGPUBuffer> active_ubuf_staging_buffers;
+    std::vector<WGPUBuffer> mapping_ubuf_staging_buffers;
+
+    // shader modules keyed by WGSL source, render pipelines by their serialized descriptor
+    std::unordered_map<std::string, GpuHandle<WGPUShaderModule>> shader_module_cache;
+    std::unordered_map<std::string, RenderPipelineCacheEntry> render_pipeline_cache;
+    std::vector<GpuHandle<WGPUPipelineLayout>> render_pipeline_cache_layouts;
+    struct {
+        uint32_t shader_hits = 0;
+        uint32_t shader_misses = 0;
+        double shader_ms = 0.0;
+        uint32_t pipeline_hits = 0;
+        uint32_t pipeline_misses = 0;
+        double pipeline_ms = 0.0;
+        uint32_t pipelines_pending = 0;
+        double pipeline_async_ms = 0.0;
+    } pipeline_cache_stats;
 
     struct GuiBufOffset {
         uint32_t v_offset;
@@ -83,165 +883,889 @@ struct
         uint32_t i_size;
     };
     std::vector<GuiBufOffset> gui_buf_offsets;
-    WGPUShaderModule gui_shader_module = nullptr;
-    WGPUBuffer gui_vbuf = nullptr;
-    WGPUBuffer gui_ibuf = nullptr;
-    WGPUBuffer gui_ubuf = nullptr;
-    WGPUTexture gui_font_texture = nullptr;
-    WGPUTextureView gui_font_texture_view = nullptr;
-    WGPUSampler gui_sampler = nullptr;
-    WGPUBindGroupLayout gui_bgl = nullptr;
-    WGPUPipelineLayout gui_pl = nullptr;
-    WGPURenderPipeline gui_ps = nullptr;
-    WGPUBindGroup gui_bg = nullptr;
+    GpuHandle<WGPUShaderModule> gui_shader_module;
+    GpuHandle<WGPUBuffer> gui_vbuf;
+    GpuHandle<WGPUBuffer> gui_ibuf;
+    GpuHandle<WGPUBuffer> gui_ubuf;
+    std::unordered_map<std::string, FontSource> font_sources;
+    GuiGlyphCache gui_glyph_cache;
+    GpuHandle<WGPUTexture> gui_font_texture;
+    GpuHandle<WGPUTextureView> gui_font_texture_view;
+    GpuHandle<WGPUSampler> gui_sampler;
+    GpuHandle<WGPUBindGroupLayout> gui_bgl;
+    GpuHandle<WGPUPipelineLayout> gui_pl;
+    GpuHandle<WGPURenderPipeline> gui_ps; // font atlas (distance field)
+    GpuHandle<WGPURenderPipeline> gui_image_ps; // any other ImTextureID, which is an RGBA WGPUTextureView
+    GpuHandle<WGPURenderPipeline> gui_blit_ps; // same as the two above without depth, for the blit pass
+    GpuHandle<WGPURenderPipeline> gui_blit_image_ps;
+    std::unordered_map<WGPUTextureView, GpuHandle<WGPUBindGroup>> gui_bg_cache;
     Size last_gui_win_size;
 
+    std::vector<StartupMilestone> startup_timeline;
+
     bool quit = false;
+    InputRing input_ring;
+    InputStats input_stats;
+    CompletionQueue completions;
+    JobSystem jobs;
+    std::unordered_set<AsyncJob *> async_jobs;
+    CompletionStats completion_stats;
+    float completion_budget_ms = COMPLETION_BUDGET_MS;
     LocalFileLoadCallback local_file_load_callback = nullptr;
     LocalFileLoadFsApiCallback local_file_load_fs_api_callback = nullptr;
+    LocalFileSaveFsApiCallback local_file_save_fs_api_callback = nullptr;
+    bool fs_api = false;
+    bool fs_api_file_handle = false;
 
     Scene scene;
 } d;
 
-WGPUShaderModule create_shader_module(const char *wgsl_source)
+static void *frame_alloc(size_t size, size_t alignment = alignof(max_align_t))
 {
-    WGPUShaderModuleWGSLDescriptor wgsl_desc = {
-        .chain = {
-            .sType = WGPUSType_ShaderModuleWGSLDescriptor
-        },
-        .code = wgsl_source
-    };
-    WGPUShaderModuleDescriptor desc = {
-        .nextInChain = &wgsl_desc.chain
-    };
-    return wgpuDeviceCreateShaderModule(d.device, &desc);
+    FrameArena &a(d.frame_arena);
+    for (;;) {
+        if (a.chunk < a.chunks.size()) {
+            FrameArena::Chunk &c(a.chunks[a.chunk]);
+            const uintptr_t base = reinterpret_cast<uintptr_t>(c.data.get());
+            const size_t offset = ((base + a.used + alignment - 1) & ~uintptr_t(alignment - 1)) - base;
+            if (offset + size <= c.size) {
+                a.used = offset + size;
+                a.frame_bytes += size;
+                return c.data.get() + offset;
+            }
+            if (a.chunk + 1 < a.chunks.size() && a.chunks[a.chunk + 1].size >= size + alignment) {
+                ++a.chunk;
+                a.used = 0;
+                continue;
+            }
+        }
+        // new chunks go after the current one, larger than usual for large allocations
+        const size_t chunk_size = std::max(FRAME_ARENA_CHUNK_SIZE, size + alignment);
+        const size_t pos = a.chunks.empty() ? 0 : a.chunk + 1;
+        a.chunks.insert(a.chunks.begin() + pos, { std::unique_ptr<char[]>(new char[chunk_size]), chunk_size });
+        a.chunk = pos;
+        a.used = 0;
+    }
 }
 
-static WGPUBuffer create_buffer(WGPUBufferUsageFlags usage, uint64_t size, bool mapped = false)
+static void reset_frame_arena()
 {
-    WGPUBufferDescriptor desc = {
-        .usage = usage,
-        .size = size,
-        .mappedAtCreation = mapped
-    };
-    return wgpuDeviceCreateBuffer(d.device, &desc);
+    FrameArena &a(d.frame_arena);
+    a.peak_frame_bytes = std::max(a.peak_frame_bytes, a.frame_bytes);
+    a.frame_bytes = 0;
+    a.chunk = 0;
+    a.used = 0;
 }
 
-static WGPUBuffer create_buffer_with_data(WGPUBufferUsageFlags usage, uint64_t size, const void *data, uint32_t data_size = 0)
+// STL allocator on top of frame_alloc(), deallocation is a no-op
+template<typename T>
+struct FrameAllocator
 {
-    WGPUBuffer buffer = create_buffer(usage, size, true);
-    char *p = static_cast<char *>(wgpuBufferGetMappedRange(buffer, 0, size));
-    memcpy(p, data, data_size ? data_size : size);
-    wgpuBufferUnmap(buffer);
-    return buffer;
+    using value_type = T;
+
+    FrameAllocator() = default;
+    template<typename U>
+    FrameAllocator(const FrameAllocator<U> &) { }
+
+    T *allocate(size_t n) { return static_cast<T *>(frame_alloc(n * sizeof(T), alignof(T))); }
+    void deallocate(T *, size_t) { }
+};
+
+template<typename T, typename U>
+bool operator==(const FrameAllocator<T> &, const FrameAllocator<U> &) { return true; }
+template<typename T, typename U>
+bool operator!=(const FrameAllocator<T> &, const FrameAllocator<U> &) { return false; }
+
+template<typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+static void sample_heap_stats()
+{
+    HeapStats &h(d.heap_stats);
+    const double now = emscripten_get_now();
+    if (h.sample_count && now - h.last_sample_time < HEAP_SAMPLE_INTERVAL_MS)
+        return;
+    h.last_sample_time = now;
+    const struct mallinfo mi = mallinfo();
+    const int i = h.sample_count++ % HEAP_SAMPLE_COUNT;
+    h.in_use_mb[i] = mi.uordblks / (1024.0f * 1024.0f);
+    h.free_mb[i] = mi.fordblks / (1024.0f * 1024.0f);
 }
 
-static WGPUBuffer create_uniform_buffer(uint64_t size)
+// Thread-safe
+static void post_completion(const Completion &c)
 {
-    return create_buffer(WGPUBufferUsage_Uniform | WGPUBufferUsage_CopyDst, size);
+    CompletionQueue &q(d.completions);
+    if (!q.overflowing.load(std::memory_order_acquire) && q.try_push(c))
+        return;
+    std::lock_guard<std::mutex> lock(q.overflow_mutex);
+    q.overflow.push_back(c);
+    q.overflowing.store(true, std::memory_order_release);
 }
 
-static WGPUBuffer create_staging_buffer(uint64_t size)
+// Called at the start of each frame. Completions run in the order they were posted until the
+// time budget is used up (at least one runs per frame), the rest and whatever gets posted
+// while these run wait for the next frame.
+static void run_completions()
 {
-    return create_buffer(WGPUBufferUsage_MapWrite | WGPUBufferUsage_CopySrc, size, true);
+    CompletionQueue &q(d.completions);
+    CompletionStats &stats(d.completion_stats);
+    const double t0 = emscripten_get_now();
+    const uint32_t end = q.enqueue_pos.load(std::memory_order_acquire);
+    uint32_t run = 0;
+    uint32_t overflow_left = 0;
+    bool over_budget = false;
+    Completion c;
+    while (int32_t(end - q.dequeue_pos) > 0 && !over_budget && q.try_pop(&c)) {
+        c();
+        ++run;
+        over_budget = emscripten_get_now() - t0 >= d.completion_budget_ms;
+    }
+    // everything in the overflow was posted after what is in the ring, including what was
+    // posted to it while the above ran, so the ring has to be empty, not just drained to end.
+    // The flag is read first: what got into the ring before the spill started is then seen.
+    if (!over_budget && q.overflowing.load(std::memory_order_acquire) && q.dequeue_pos == q.enqueue_pos.load(std::memory_order_acquire)) {
+        if (q.spilled_pos == q.spilled.size()) {
+            q.spilled.clear();
+            q.spilled_pos = 0;
+            std::lock_guard<std::mutex> lock(q.overflow_mutex);
+            q.spilled.swap(q.overflow);
+        }
+        const size_t first = q.spilled_pos;
+        while (q.spilled_pos < q.spilled.size() && !over_budget) {
+            q.spilled[q.spilled_pos++]();
+            over_budget = emscripten_get_now() - t0 >= d.completion_budget_ms;
+        }
+        stats.overflows += uint32_t(q.spilled_pos - first);
+        run += uint32_t(q.spilled_pos - first);
+        overflow_left = uint32_t(q.spilled.size() - q.spilled_pos);
+        if (!overflow_left) {
+            // posting to the ring resumes once nothing is left to run before it
+            std::lock_guard<std::mutex> lock(q.overflow_mutex);
+            if (q.overflow.empty())
+                q.overflowing.store(false, std::memory_order_release);
+        }
+    }
+    const float ms = float(emscripten_get_now() - t0);
+    stats.run += run;
+    stats.last_frame_run = run;
+    stats.max_frame_run = std::max(stats.max_frame_run, run);
+    stats.carried_over = q.size() + overflow_left;
+    stats.last_drain_ms = ms;
+    stats.max_drain_ms = std::max(stats.max_drain_ms, ms);
 }
 
-struct UBufStagingArea
+static void start_jobs()
 {
-    char *p;
-    WGPUBuffer buf;
-};
+    uint32_t workers = 0;
+#if JOBS_THREADED
+    workers = std::min(std::max(std::thread::hardware_concurrency(), 1u), MAX_JOB_THREADS) - 1;
+#endif
+    d.jobs.start(workers);
+    printf("Jobs: %u worker thread(s)\n", workers);
+}
 
-static UBufStagingArea next_ubuf_staging_area_for_current_frame()
+// Splits [0, count) into pieces of at least min_chunk and calls body(first, n) for each of
+// them, on whichever threads are free, returning when all are done. max_chunks limits how
+// many threads can take part (0 means a few pieces per thread). body may call parallel_for.
+static void parallel_for(size_t count, size_t min_chunk, const Delegate<void(size_t first, size_t n)> &body, uint32_t max_chunks = 0)
 {
-    WGPUBuffer buf;
-    if (d.free_ubuf_staging_buffers.empty()) {
-        buf = create_staging_buffer(MAX_UBUF_SIZE);
-    } else {
-        buf = d.free_ubuf_staging_buffers.back();
-        d.free_ubuf_staging_buffers.pop_back();
+    size_t chunks = max_chunks ? max_chunks : d.jobs.thread_count() * 4;
+    chunks = std::min(chunks, (count + min_chunk - 1) / std::max<size_t>(min_chunk, 1));
+    if (chunks <= 1 || d.jobs.queues.empty()) {
+        if (count)
+            body(0, count);
+        return;
     }
-    d.active_ubuf_staging_buffers.push_back(buf);
-    return {
-        static_cast<char *>(wgpuBufferGetMappedRange(buf, 0, MAX_UBUF_SIZE)),
-        buf
-    };
+    JobCounter counter;
+    const Delegate<void(size_t, size_t)> *b = &body;
+    for (size_t i = 1; i < chunks; ++i) {
+        const size_t first = count * i / chunks;
+        const size_t n = count * (i + 1) / chunks - first;
+        d.jobs.push(&counter, [b, first, n] { (*b)(first, n); });
+    }
+    body(0, count / chunks);
+    d.jobs.wait(&counter);
 }
 
-static void enqueue_ubuf_staging_copy(const UBufStagingArea &u, WGPUBuffer dst, uint32_t size, uint32_t src_offset = 0, uint32_t dst_offset = 0)
+static void finish_job_async(AsyncJob *a)
 {
-    wgpuCommandEncoderCopyBufferToBuffer(d.res_encoder, u.buf, src_offset, dst, dst_offset, size);
+    a->then();
+    d.async_jobs.erase(a);
+    delete a;
 }
 
-static void releaseAndNull(WGPUTexture &obj)
+// Runs work on a worker thread, then the continuation on the main thread through the
+// completion queue. Without worker threads both run from the completion queue. Main thread
+// only.
+static void run_job_async(const Job &work, const Completion &then)
 {
-    if (obj) {
-        wgpuTextureDestroy(obj);
-        obj = nullptr;
+    AsyncJob *a = new AsyncJob { work, then };
+    d.async_jobs.insert(a);
+    if (d.jobs.thread_count() < 2) {
+        post_completion([a] {
+            a->work();
+            finish_job_async(a);
+        });
+        return;
     }
+    d.jobs.push(nullptr, [a] {
+        a->work();
+        post_completion([a] { finish_job_async(a); });
+    });
 }
 
-static void releaseAndNull(WGPUTextureView &obj)
+// The main thread's performance.now(). Not emscripten_get_now(): with pthreads that adds
+// performance.timeOrigin so that all threads share one clock.
+EM_JS(double, ms_since_navigation_start, (), {
+    return performance.now();
+});
+
+// Records a startup milestone the first time it is reached, later calls are ignored
+static void startup_milestone(const char *name)
 {
-    if (obj) {
-        wgpuTextureViewRelease(obj);
-        obj = nullptr;
+    for (const StartupMilestone &m : d.startup_timeline) {
+        if (!strcmp(m.name, name))
+            return;
     }
+    const double ms = ms_since_navigation_start();
+    printf("Startup: %s at %.1f ms\n", name, ms);
+    d.startup_timeline.push_back({ name, ms });
 }
 
-static void releaseAndNull(WGPUSampler &obj)
+// Returns a new reference, identical sources share one module
+WGPUShaderModule create_shader_module(const char *wgsl_source)
 {
-    if (obj) {
-        wgpuSamplerRelease(obj);
-        obj = nullptr;
+    GpuHandle<WGPUShaderModule> &module(d.shader_module_cache[wgsl_source]);
+    if (module) {
+        ++d.pipeline_cache_stats.shader_hits;
+    } else {
+        WGPUShaderModuleWGSLDescriptor wgsl_desc = {
+            .chain = {
+                .sType = WGPUSType_ShaderModuleWGSLDescriptor
+            },
+            .code = wgsl_source
+        };
+        WGPUShaderModuleDescriptor desc = {
+            .nextInChain = &wgsl_desc.chain
+        };
+        const double t0 = emscripten_get_now();
+        module = wgpuDeviceCreateShaderModule(d.device, &desc);
+        const double ms = emscripten_get_now() - t0;
+        ++d.pipeline_cache_stats.shader_misses;
+        d.pipeline_cache_stats.shader_ms += ms;
+        if (LOG_GPU_OBJECT_CREATION)
+            printf("Created shader module (%zu bytes of WGSL) in %.3f ms\n", strlen(wgsl_source), ms);
     }
+    wgpuShaderModuleReference(module);
+    return module;
 }
 
-static void releaseAndNull(WGPUBuffer &obj)
+template<typename T>
+static void append_key(std::string *key, const T &v)
 {
-    if (obj) {
-        wgpuBufferDestroy(obj);
-        obj = nullptr;
-    }
+    key->append(reinterpret_cast<const char *>(&v), sizeof(T));
 }
 
-static void releaseAndNull(WGPUShaderModule &obj)
+static void append_key(std::string *key, const char *str)
 {
-    if (obj) {
-        wgpuShaderModuleRelease(obj);
-        obj = nullptr;
-    }
+    key->append(str ? str : "");
+    key->push_back('\0');
 }
 
-static void releaseAndNull(WGPUBindGroupLayout &obj)
+static void append_key(std::string *key, const WGPUBlendComponent &c)
 {
-    if (obj) {
-        wgpuBindGroupLayoutRelease(obj);
-        obj = nullptr;
-    }
+    append_key(key, c.operation);
+    append_key(key, c.srcFactor);
+    append_key(key, c.dstFactor);
 }
 
-static void releaseAndNull(WGPUPipelineLayout &obj)
+static void append_key(std::string *key, const WGPUStencilFaceState &s)
 {
-    if (obj) {
-        wgpuPipelineLayoutRelease(obj);
-        obj = nullptr;
-    }
+    append_key(key, s.compare);
+    append_key(key, s.failOp);
+    append_key(key, s.depthFailOp);
+    append_key(key, s.passOp);
 }
 
-static void releaseAndNull(WGPURenderPipeline &obj)
+static void append_key(std::string *key, uint32_t constant_count, const WGPUConstantEntry *constants)
 {
-    if (obj) {
-        wgpuRenderPipelineRelease(obj);
-        obj = nullptr;
+    append_key(key, constant_count);
+    for (uint32_t i = 0; i < constant_count; ++i) {
+        append_key(key, constants[i].key);
+        append_key(key, constants[i].value);
     }
 }
 
-static void releaseAndNull(WGPUBindGroup &obj)
+// Every field of the descriptor that affects the pipeline, objects (layout, modules) by handle
+static std::string render_pipeline_key(const WGPURenderPipelineDescriptor &desc)
 {
-    if (obj) {
-        wgpuBindGroupRelease(obj);
-        obj = nullptr;
+    std::string key;
+    append_key(&key, desc.layout);
+    append_key(&key, desc.vertex.module);
+    append_key(&key, desc.vertex.entryPoint);
+    append_key(&key, desc.vertex.constantCount, desc.vertex.constants);
+    append_key(&key, desc.vertex.bufferCount);
+    for (uint32_t i = 0; i < desc.vertex.bufferCount; ++i) {
+        const WGPUVertexBufferLayout &b(desc.vertex.buffers[i]);
+        append_key(&key, b.arrayStride);
+        append_key(&key, b.stepMode);
+        append_key(&key, b.attributeCount);
+        for (uint32_t j = 0; j < b.attributeCount; ++j) {
+            append_key(&key, b.attributes[j].format);
+            append_key(&key, b.attributes[j].offset);
+            append_key(&key, b.attributes[j].shaderLocation);
+        }
+    }
+    append_key(&key, desc.primitive.topology);
+    append_key(&key, desc.primitive.stripIndexFormat);
+    append_key(&key, desc.primitive.frontFace);
+    append_key(&key, desc.primitive.cullMode);
+    append_key(&key, bool(desc.depthStencil));
+    if (desc.depthStencil) {
+        const WGPUDepthStencilState &ds(*desc.depthStencil);
+        append_key(&key, ds.format);
+        append_key(&key, ds.depthWriteEnabled);
+        append_key(&key, ds.depthCompare);
+        append_key(&key, ds.stencilFront);
+        append_key(&key, ds.stencilBack);
+        append_key(&key, ds.stencilReadMask);
+        append_key(&key, ds.stencilWriteMask);
+        append_key(&key, ds.depthBias);
+        append_key(&key, ds.depthBiasSlopeScale);
+        append_key(&key, ds.depthBiasClamp);
+    }
+    append_key(&key, desc.multisample.count);
+    append_key(&key, desc.multisample.mask);
+    append_key(&key, desc.multisample.alphaToCoverageEnabled);
+    append_key(&key, bool(desc.fragment));
+    if (desc.fragment) {
+        const WGPUFragmentState &fs(*desc.fragment);
+        append_key(&key, fs.module);
+        append_key(&key, fs.entryPoint);
+        append_key(&key, fs.constantCount, fs.constants);
+        append_key(&key, fs.targetCount);
+        for (uint32_t i = 0; i < fs.targetCount; ++i) {
+            const WGPUColorTargetState &t(fs.targets[i]);
+            append_key(&key, t.format);
+            append_key(&key, t.writeMask);
+            append_key(&key, bool(t.blend));
+            if (t.blend) {
+                append_key(&key, t.blend->color);
+                append_key(&key, t.blend->alpha);
+            }
+        }
+    }
+    return key;
+}
+
+// The cache holds on to the layouts it has seen so that their handles are not reused for
+// other layouts while keys refer to them (modules are kept alive by the shader module cache).
+static void keep_render_pipeline_cache_layout(WGPUPipelineLayout layout)
+{
+    if (layout) {
+        wgpuPipelineLayoutReference(layout);
+        d.render_pipeline_cache_layouts.push_back(layout);
+    }
+}
+
+// Returns a new reference, pipelines with identical state are created only once
+static WGPURenderPipeline create_render_pipeline(const WGPURenderPipelineDescriptor &desc)
+{
+    RenderPipelineCacheEntry &e(d.render_pipeline_cache[render_pipeline_key(desc)]);
+    if (e.ps) {
+        ++d.pipeline_cache_stats.pipeline_hits;
+    } else {
+        // when an asynchronous creation is in flight, its result is dropped when it arrives
+        const double t0 = emscripten_get_now();
+        e.ps = wgpuDeviceCreateRenderPipeline(d.device, &desc);
+        const double ms = emscripten_get_now() - t0;
+        ++d.pipeline_cache_stats.pipeline_misses;
+        d.pipeline_cache_stats.pipeline_ms += ms;
+        if (LOG_GPU_OBJECT_CREATION) {
+            printf("Created render pipeline (%s/%s) in %.3f ms\n", desc.vertex.entryPoint,
+                   desc.fragment ? desc.fragment->entryPoint : "-", ms);
+        }
+        if (!e.pending)
+            keep_render_pipeline_cache_layout(desc.layout);
+    }
+    wgpuRenderPipelineReference(e.ps);
+    return e.ps;
+}
+
+struct RenderPipelineAsyncRequest
+{
+    std::string key;
+    double t0;
+};
+
+static void finish_render_pipeline_async(RenderPipelineAsyncRequest *r, WGPUCreatePipelineAsyncStatus status, WGPURenderPipeline ps)
+{
+    std::unique_ptr<RenderPipelineAsyncRequest> request(r);
+    auto it = d.render_pipeline_cache.find(request->key);
+    if (it == d.render_pipeline_cache.end()) {
+        // the cache was cleared in the meantime
+        if (ps)
+            wgpuRenderPipelineRelease(ps);
+        return;
+    }
+    RenderPipelineCacheEntry &e(it->second);
+    const double ms = emscripten_get_now() - request->t0;
+    e.pending = false;
+    if (!--d.pipeline_cache_stats.pipelines_pending)
+        startup_milestone("async pipelines ready");
+    d.pipeline_cache_stats.pipeline_async_ms += ms;
+    std::vector<RenderPipelineReadyCallback> waiters = std::move(e.waiters);
+    e.waiters.clear();
+    if (status != WGPUCreatePipelineAsyncStatus_Success) {
+        if (ps)
+            wgpuRenderPipelineRelease(ps);
+        if (!e.ps)
+            d.render_pipeline_cache.erase(it);
+        for (const RenderPipelineReadyCallback &w : waiters)
+            w(nullptr);
+        return;
+    }
+    if (LOG_GPU_OBJECT_CREATION)
+        printf("Created render pipeline asynchronously in %.3f ms\n", ms);
+    if (e.ps)
+        wgpuRenderPipelineRelease(ps);
+    else
+        e.ps = ps;
+    // waiters may request more pipelines, do not touch e after this
+    ps = e.ps;
+    for (const RenderPipelineReadyCallback &w : waiters) {
+        wgpuRenderPipelineReference(ps);
+        w(ps);
+    }
+}
+
+// Like create_render_pipeline(), but without blocking: the callback is invoked right away
+// when the pipeline is in the cache, otherwise at the start of the frame after the browser
+// has finished compiling it. Requests for a pipeline that is already being created share
+// that creation.
+static void create_render_pipeline_async(const WGPURenderPipelineDescriptor &desc, const RenderPipelineReadyCallback &callback)
+{
+    std::string key = render_pipeline_key(desc);
+    RenderPipelineCacheEntry &e(d.render_pipeline_cache[key]);
+    if (e.ps) {
+        ++d.pipeline_cache_stats.pipeline_hits;
+        wgpuRenderPipelineReference(e.ps);
+        callback(e.ps);
+        return;
+    }
+    e.waiters.push_back(callback);
+    if (e.pending) {
+        ++d.pipeline_cache_stats.pipeline_hits;
+        return;
+    }
+    e.pending = true;
+    ++d.pipeline_cache_stats.pipeline_misses;
+    ++d.pipeline_cache_stats.pipelines_pending;
+    keep_render_pipeline_cache_layout(desc.layout);
+
+    RenderPipelineAsyncRequest *request = new RenderPipelineAsyncRequest { std::move(key), emscripten_get_now() };
+    wgpuDeviceCreateRenderPipelineAsync(d.device, &desc, [](WGPUCreatePipelineAsyncStatus status, WGPURenderPipeline ps, const char *message, void *userdata) {
+        // the message does not outlive this callback
+        if (status != WGPUCreatePipelineAsyncStatus_Success)
+            printf("Failed to create render pipeline: %s\n", message ? message : "");
+        RenderPipelineAsyncRequest *request = static_cast<RenderPipelineAsyncRequest *>(userdata);
+        post_completion([request, status, ps] { finish_render_pipeline_async(request, status, ps); });
+    }, request);
+}
+
+static void track_gpu_memory(const void *obj, GpuMemoryCategory category, uint64_t bytes)
+{
+    GpuMemoryTracker &t(d.gpu_memory);
+    GpuMemoryTracker::Category &c(t.categories[int(category)]);
+    t.objects[obj] = { category, bytes };
+    c.bytes += bytes;
+    c.peak_bytes = std::max(c.peak_bytes, c.bytes);
+    ++c.count;
+    t.total_bytes += bytes;
+    t.peak_bytes = std::max(t.peak_bytes, t.total_bytes);
+}
+
+static void untrack_gpu_memory(const void *obj)
+{
+    GpuMemoryTracker &t(d.gpu_memory);
+    auto it = t.objects.find(obj);
+    if (it == t.objects.end())
+        return;
+    GpuMemoryTracker::Category &c(t.categories[int(it->second.category)]);
+    c.bytes -= it->second.bytes;
+    --c.count;
+    t.total_bytes -= it->second.bytes;
+    t.objects.erase(it);
+}
+
+static void add_gpu_memory_evictor(const void *owner, const GpuMemoryEvictCallback &evict)
+{
+    d.gpu_memory.evictors.push_back({ owner, evict });
+}
+
+static void remove_gpu_memory_evictors(const void *owner)
+{
+    std::vector<GpuMemoryTracker::Evictor> &evictors(d.gpu_memory.evictors);
+    evictors.erase(std::remove_if(evictors.begin(), evictors.end(), [owner](const GpuMemoryTracker::Evictor &e) {
+        return e.owner == owner;
+    }), evictors.end());
+}
+
+static void enforce_gpu_memory_budget()
+{
+    GpuMemoryTracker &t(d.gpu_memory);
+    if (t.total_bytes <= uint64_t(t.budget_mb * 1024.0 * 1024.0) || d.frame_count - t.last_evict_frame < GPU_MEMORY_EVICT_INTERVAL_FRAMES)
+        return;
+    for (const GpuMemoryTracker::Evictor &e : t.evictors) {
+        if (e.evict()) {
+            t.last_evict_frame = d.frame_count;
+            ++t.eviction_count;
+            return;
+        }
+    }
+}
+
+static void report_gpu_memory_leaks()
+{
+    for (const auto &it : d.gpu_memory.objects) {
+        printf("GPU memory leak: %s, %llu bytes (%p)\n", gpu_memory_category_names[int(it.second.category)],
+               (unsigned long long) it.second.bytes, it.first);
+    }
+}
+
+static WGPUBuffer create_buffer(WGPUBufferUsageFlags usage, uint64_t size, bool mapped = false)
+{
+    WGPUBufferDescriptor desc = {
+        .usage = usage,
+        .size = size,
+        .mappedAtCreation = mapped
+    };
+    WGPUBuffer buffer = wgpuDeviceCreateBuffer(d.device, &desc);
+    const bool staging = usage & (WGPUBufferUsage_MapWrite | WGPUBufferUsage_MapRead);
+    track_gpu_memory(buffer, staging ? GpuMemoryCategory::Staging : GpuMemoryCategory::Buffers, size);
+    return buffer;
+}
+
+static WGPUBuffer create_buffer_with_data(WGPUBufferUsageFlags usage, uint64_t size, const void *data, uint32_t data_size = 0)
+{
+    WGPUBuffer buffer = create_buffer(usage, size, true);
+    char *p = static_cast<char *>(wgpuBufferGetMappedRange(buffer, 0, size));
+    memcpy(p, data, data_size ? data_size : size);
+    wgpuBufferUnmap(buffer);
+    return buffer;
+}
+
+static WGPUBuffer create_uniform_buffer(uint64_t size)
+{
+    return create_buffer(WGPUBufferUsage_Uniform | WGPUBufferUsage_CopyDst, size);
+}
+
+static WGPUBuffer create_staging_buffer(uint64_t size)
+{
+    return create_buffer(WGPUBufferUsage_MapWrite | WGPUBufferUsage_CopySrc, size, true);
+}
+
+struct UBufStagingArea
+{
+    char *p;
+    WGPUBuffer buf;
+};
+
+// size can go beyond MAX_UBUF_SIZE for bulk per-frame data (e.g. per-instance matrices),
+// such buffers are then recycled the same way
+static UBufStagingArea next_ubuf_staging_area_for_current_frame(uint32_t size = MAX_UBUF_SIZE)
+{
+    // the smallest free buffer that fits, so that the few large ones are kept for large requests
+    std::vector<WGPUBuffer> &free_bufs(d.free_ubuf_staging_buffers);
+    auto best = free_bufs.end();
+    uint64_t best_size = UINT64_MAX;
+    for (auto it = free_bufs.begin(); it != free_bufs.end(); ++it) {
+        const uint64_t buf_size = wgpuBufferGetSize(*it);
+        if (buf_size >= size && buf_size < best_size) {
+            best = it;
+            best_size = buf_size;
+            if (buf_size == size)
+                break;
+        }
+    }
+    WGPUBuffer buf = nullptr;
+    if (best != free_bufs.end()) {
+        buf = *best;
+        free_bufs.erase(best);
+    } else {
+        buf = create_staging_buffer(std::max(size, MAX_UBUF_SIZE));
+    }
+    d.active_ubuf_staging_buffers.push_back(buf);
+    return {
+        static_cast<char *>(wgpuBufferGetMappedRange(buf, 0, wgpuBufferGetSize(buf))),
+        buf
+    };
+}
+
+static void enqueue_ubuf_staging_copy(const UBufStagingArea &u, WGPUBuffer dst, uint32_t size, uint32_t src_offset = 0, uint32_t dst_offset = 0)
+{
+    wgpuCommandEncoderCopyBufferToBuffer(d.res_encoder, u.buf, src_offset, dst, dst_offset, size);
+}
+
+static void release_now(WGPUTexture obj)
+{
+    // frees the memory right away instead of whenever the handle gets garbage collected
+    untrack_gpu_memory(obj);
+    wgpuTextureDestroy(obj);
+    wgpuTextureRelease(obj);
+}
+
+static void release_now(WGPUTextureView obj)
+{
+    wgpuTextureViewRelease(obj);
+}
+
+static void release_now(WGPUSampler obj)
+{
+    wgpuSamplerRelease(obj);
+}
+
+static void release_now(WGPUBuffer obj)
+{
+    untrack_gpu_memory(obj);
+    wgpuBufferDestroy(obj);
+    wgpuBufferRelease(obj);
+}
+
+static void release_now(WGPUShaderModule obj)
+{
+    wgpuShaderModuleRelease(obj);
+}
+
+static void release_now(WGPUBindGroupLayout obj)
+{
+    wgpuBindGroupLayoutRelease(obj);
+}
+
+static void release_now(WGPUPipelineLayout obj)
+{
+    wgpuPipelineLayoutRelease(obj);
+}
+
+static void release_now(WGPURenderPipeline obj)
+{
+    wgpuRenderPipelineRelease(obj);
+}
+
+static void release_now(WGPURenderBundle obj)
+{
+    wgpuRenderBundleRelease(obj);
+}
+
+static void release_now(WGPUBindGroup obj)
+{
+    wgpuBindGroupRelease(obj);
+}
+
+static void release_now(GpuHeapAllocation *a);
+
+template<typename T>
+static void release_now_erased(void *obj)
+{
+    release_now(static_cast<T>(obj));
+}
+
+// Releases obj once the GPU is done with everything submitted so far (and in this frame)
+template<typename T>
+static void defer_release(T obj)
+{
+    if (obj)
+        d.deferred_releases.push_back({ d.frame_count, release_now_erased<T>, obj });
+}
+
+// Releases what the GPU has finished with, or everything when shutting down
+static void process_deferred_releases(bool all = false)
+{
+    size_t n = 0;
+    while (n < d.deferred_releases.size() && (all || d.deferred_releases[n].frame <= d.completed_frame)) {
+        d.deferred_releases[n].release(d.deferred_releases[n].obj);
+        ++n;
+    }
+    d.deferred_releases.erase(d.deferred_releases.begin(), d.deferred_releases.begin() + n);
+}
+
+template<typename T>
+static void releaseAndNull(T &obj)
+{
+    defer_release(obj);
+    obj = nullptr;
+}
+
+static uint64_t gpu_heap_alignment(GpuHeapKind kind)
+{
+    // minUniformBufferOffsetAlignment and minStorageBufferOffsetAlignment
+    return kind == GpuHeapKind::Uniform || kind == GpuHeapKind::Storage ? 256 : 4;
+}
+
+static WGPUBufferUsageFlags gpu_heap_usage(GpuHeapKind kind)
+{
+    switch (kind) {
+    case GpuHeapKind::Vertex:
+        return WGPUBufferUsage_Vertex | WGPUBufferUsage_CopyDst;
+    case GpuHeapKind::Index:
+        return WGPUBufferUsage_Index | WGPUBufferUsage_CopyDst;
+    case GpuHeapKind::Uniform:
+        return WGPUBufferUsage_Uniform | WGPUBufferUsage_CopyDst;
+    default:
+        return WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst;
+    }
+}
+
+// ranges in class c are at least 2^c bytes
+static int gpu_heap_size_class(uint64_t size)
+{
+    int c = 0;
+    while (c < GPU_HEAP_SIZE_CLASSES - 1 && (uint64_t(2) << c) <= size)
+        ++c;
+    return c;
+}
+
+static void gpu_heap_remove_free_range(GpuHeap *heap, int block, uint64_t offset, uint64_t size)
+{
+    heap->blocks[block].free_ranges.erase(offset);
+    heap->size_classes[gpu_heap_size_class(size)].erase({ block, offset });
+}
+
+static void gpu_heap_add_free_range(GpuHeap *heap, int block, uint64_t offset, uint64_t size)
+{
+    std::map<uint64_t, uint64_t> &ranges(heap->blocks[block].free_ranges);
+    auto next = ranges.lower_bound(offset);
+    if (next != ranges.end() && offset + size == next->first) {
+        heap->size_classes[gpu_heap_size_class(next->second)].erase({ block, next->first });
+        size += next->second;
+        next = ranges.erase(next);
+    }
+    if (next != ranges.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            heap->size_classes[gpu_heap_size_class(prev->second)].erase({ block, prev->first });
+            offset = prev->first;
+            size += prev->second;
+            ranges.erase(prev);
+        }
+    }
+    ranges[offset] = size;
+    heap->size_classes[gpu_heap_size_class(size)].insert({ block, offset });
+}
+
+// size is rounded up to the alignment of the kind
+static GpuHeapAllocation *gpu_heap_alloc(GpuHeapKind kind, uint64_t size)
+{
+    GpuHeap &heap(d.gpu_heaps[int(kind)]);
+    const uint64_t alignment = gpu_heap_alignment(kind);
+    size = std::max<uint64_t>(size, 1);
+    size = (size + alignment - 1) / alignment * alignment;
+
+    GpuHeapAllocation *a = new GpuHeapAllocation;
+    a->kind = kind;
+    a->size = size;
+    if (size > GPU_HEAP_MAX_SUBALLOCATION) {
+        a->buffer = create_buffer(gpu_heap_usage(kind), size);
+        ++heap.dedicated_count;
+        heap.dedicated_bytes += size;
+        return a;
+    }
+
+    int block = -1;
+    uint64_t offset = 0;
+    uint64_t range_size = 0;
+    // any range in the classes above the size fits, the class of the size itself may have one
+    const int size_class = gpu_heap_size_class(size);
+    for (int c = size_class + ((uint64_t(1) << size_class) < size ? 1 : 0); c < GPU_HEAP_SIZE_CLASSES && block < 0; ++c) {
+        if (!heap.size_classes[c].empty()) {
+            block = heap.size_classes[c].begin()->first;
+            offset = heap.size_classes[c].begin()->second;
+        }
+    }
+    if (block < 0) {
+        for (const auto &r : heap.size_classes[size_class]) {
+            if (heap.blocks[r.first].free_ranges[r.second] >= size) {
+                block = r.first;
+                offset = r.second;
+                break;
+            }
+        }
+    }
+    if (block < 0) {
+        block = int(heap.blocks.size());
+        heap.blocks.push_back({ create_buffer(gpu_heap_usage(kind), GPU_HEAP_BLOCK_SIZE), {} });
+        gpu_heap_add_free_range(&heap, block, 0, GPU_HEAP_BLOCK_SIZE);
+        offset = 0;
+    }
+    range_size = heap.blocks[block].free_ranges[offset];
+    gpu_heap_remove_free_range(&heap, block, offset, range_size);
+    if (range_size > size)
+        gpu_heap_add_free_range(&heap, block, offset + size, range_size - size);
+
+    a->buffer = heap.blocks[block].buffer;
+    a->offset = offset;
+    a->block = block;
+    ++heap.allocation_count;
+    heap.allocated_bytes += size;
+    return a;
+}
+
+// data_size must be a multiple of 4 (wgpuQueueWriteBuffer)
+static GpuHeapAllocation *gpu_heap_alloc_with_data(GpuHeapKind kind, uint64_t size, const void *data)
+{
+    GpuHeapAllocation *a = gpu_heap_alloc(kind, size);
+    wgpuQueueWriteBuffer(d.queue, a->buffer, a->offset, data, size);
+    return a;
+}
+
+static void release_now(GpuHeapAllocation *a)
+{
+    GpuHeap &heap(d.gpu_heaps[int(a->kind)]);
+    if (a->block < 0) {
+        release_now(a->buffer);
+        --heap.dedicated_count;
+        heap.dedicated_bytes -= a->size;
+    } else {
+        gpu_heap_add_free_range(&heap, a->block, a->offset, a->size);
+        --heap.allocation_count;
+        heap.allocated_bytes -= a->size;
+    }
+    delete a;
+}
+
+struct GpuHeapStats
+{
+    uint64_t block_bytes = 0;
+    uint32_t free_range_count = 0;
+    uint64_t free_bytes = 0;
+    uint64_t largest_free_range = 0;
+};
+
+static GpuHeapStats gpu_heap_stats(GpuHeapKind kind)
+{
+    const GpuHeap &heap(d.gpu_heaps[int(kind)]);
+    GpuHeapStats stats;
+    stats.block_bytes = heap.blocks.size() * GPU_HEAP_BLOCK_SIZE;
+    for (const GpuHeapBlock &b : heap.blocks) {
+        for (const auto &r : b.free_ranges) {
+            ++stats.free_range_count;
+            stats.free_bytes += r.second;
+            stats.largest_free_range = std::max(stats.largest_free_range, r.second);
+        }
+    }
+    return stats;
+}
+
+// After all allocations are released, blocks are kept until then
+static void release_gpu_heaps()
+{
+    for (GpuHeap &heap : d.gpu_heaps) {
+        if (heap.allocation_count || heap.dedicated_count)
+            printf("GPU heap: %u allocations and %u dedicated buffers still alive\n", heap.allocation_count, heap.dedicated_count);
+        for (GpuHeapBlock &b : heap.blocks)
+            releaseAndNull(b.buffer);
+        heap = GpuHeap();
     }
 }
 
@@ -293,13 +1817,156 @@ static void releaseAndNull(WGPUInstance &obj)
     }
 }
 
-static WGPUTexture rebuild_gui_font_atlas()
+// 16-byte wide compare helpers: wasm SIMD128 when built with -msimd128, SSE2 or
+// NEON for native builds, plain loops otherwise. Masks have bit N set when byte N matches.
+
+#if defined(__wasm_simd128__)
+using u8x16 = v128_t;
+static inline u8x16 u8x16_load(const void *p) { return wasm_v128_load(p); }
+static inline u8x16 u8x16_splat(uint8_t c) { return wasm_i8x16_splat(c); }
+static inline uint32_t u8x16_eq_mask(u8x16 a, u8x16 b) { return wasm_i8x16_bitmask(wasm_i8x16_eq(a, b)); }
+static inline uint32_t u8x16_high_mask(u8x16 a) { return wasm_i8x16_bitmask(a); }
+#elif defined(__SSE2__)
+using u8x16 = __m128i;
+static inline u8x16 u8x16_load(const void *p) { return _mm_loadu_si128(static_cast<const __m128i *>(p)); }
+static inline u8x16 u8x16_splat(uint8_t c) { return _mm_set1_epi8(char(c)); }
+static inline uint32_t u8x16_eq_mask(u8x16 a, u8x16 b) { return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))); }
+static inline uint32_t u8x16_high_mask(u8x16 a) { return uint32_t(_mm_movemask_epi8(a)); }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+using u8x16 = uint8x16_t;
+static inline uint32_t u8x16_movemask(uint8x16_t v)
 {
-    ImGuiIO &io(ImGui::GetIO());
-    unsigned char *pixels;
-    int w, h;
-    io.Fonts->GetTexDataAsRGBA32(&pixels, &w, &h);
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t m = vandq_u8(v, vld1q_u8(bits));
+    return uint32_t(vaddv_u8(vget_low_u8(m))) | (uint32_t(vaddv_u8(vget_high_u8(m))) << 8);
+}
+static inline u8x16 u8x16_load(const void *p) { return vld1q_u8(static_cast<const uint8_t *>(p)); }
+static inline u8x16 u8x16_splat(uint8_t c) { return vdupq_n_u8(c); }
+static inline uint32_t u8x16_eq_mask(u8x16 a, u8x16 b) { return u8x16_movemask(vceqq_u8(a, b)); }
+static inline uint32_t u8x16_high_mask(u8x16 a) { return u8x16_movemask(vcgeq_u8(a, vdupq_n_u8(0x80))); }
+#else
+struct u8x16 { uint8_t b[16]; };
+static inline u8x16 u8x16_load(const void *p) { u8x16 v; memcpy(v.b, p, 16); return v; }
+static inline u8x16 u8x16_splat(uint8_t c) { u8x16 v; memset(v.b, c, 16); return v; }
+static inline uint32_t u8x16_eq_mask(u8x16 a, u8x16 b)
+{
+    uint32_t m = 0;
+    for (int i = 0; i < 16; ++i)
+        m |= uint32_t(a.b[i] == b.b[i]) << i;
+    return m;
+}
+static inline uint32_t u8x16_high_mask(u8x16 a)
+{
+    uint32_t m = 0;
+    for (int i = 0; i < 16; ++i)
+        m |= uint32_t(a.b[i] >> 7) << i;
+    return m;
+}
+#endif
+
+// 4-wide float helpers for the transform kernels, same backends as above
+
+#if defined(__wasm_simd128__)
+using f32x4 = v128_t;
+static inline f32x4 f32x4_load(const float *p) { return wasm_v128_load(p); }
+static inline void f32x4_store(float *p, f32x4 v) { wasm_v128_store(p, v); }
+static inline f32x4 f32x4_splat(float f) { return wasm_f32x4_splat(f); }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return wasm_f32x4_add(a, b); }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { return wasm_f32x4_sub(a, b); }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return wasm_f32x4_mul(a, b); }
+static inline f32x4 f32x4_round(f32x4 a) { return wasm_f32x4_nearest(a); }
+static inline uint32_t f32x4_lt_mask(f32x4 a, f32x4 b) { return wasm_i32x4_bitmask(wasm_f32x4_lt(a, b)); }
+#elif defined(__SSE2__)
+using f32x4 = __m128;
+static inline f32x4 f32x4_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void f32x4_store(float *p, f32x4 v) { _mm_storeu_ps(p, v); }
+static inline f32x4 f32x4_splat(float f) { return _mm_set1_ps(f); }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return _mm_add_ps(a, b); }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { return _mm_sub_ps(a, b); }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return _mm_mul_ps(a, b); }
+static inline f32x4 f32x4_round(f32x4 a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+static inline uint32_t f32x4_lt_mask(f32x4 a, f32x4 b) { return uint32_t(_mm_movemask_ps(_mm_cmplt_ps(a, b))); }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+using f32x4 = float32x4_t;
+static inline f32x4 f32x4_load(const float *p) { return vld1q_f32(p); }
+static inline void f32x4_store(float *p, f32x4 v) { vst1q_f32(p, v); }
+static inline f32x4 f32x4_splat(float f) { return vdupq_n_f32(f); }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { return vaddq_f32(a, b); }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { return vsubq_f32(a, b); }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { return vmulq_f32(a, b); }
+static inline f32x4 f32x4_round(f32x4 a) { return vrndnq_f32(a); }
+static inline uint32_t f32x4_lt_mask(f32x4 a, f32x4 b)
+{
+    static const uint32_t bits[4] = { 1, 2, 4, 8 };
+    return vaddvq_u32(vandq_u32(vcltq_f32(a, b), vld1q_u32(bits)));
+}
+#else
+struct f32x4 { float f[4]; };
+static inline f32x4 f32x4_load(const float *p) { f32x4 v; memcpy(v.f, p, 16); return v; }
+static inline void f32x4_store(float *p, f32x4 v) { memcpy(p, v.f, 16); }
+static inline f32x4 f32x4_splat(float f) { return { { f, f, f, f } }; }
+static inline f32x4 f32x4_add(f32x4 a, f32x4 b) { for (int i = 0; i < 4; ++i) a.f[i] += b.f[i]; return a; }
+static inline f32x4 f32x4_sub(f32x4 a, f32x4 b) { for (int i = 0; i < 4; ++i) a.f[i] -= b.f[i]; return a; }
+static inline f32x4 f32x4_mul(f32x4 a, f32x4 b) { for (int i = 0; i < 4; ++i) a.f[i] *= b.f[i]; return a; }
+static inline f32x4 f32x4_round(f32x4 a) { for (int i = 0; i < 4; ++i) a.f[i] = nearbyintf(a.f[i]); return a; }
+static inline uint32_t f32x4_lt_mask(f32x4 a, f32x4 b)
+{
+    uint32_t m = 0;
+    for (int i = 0; i < 4; ++i)
+        m |= uint32_t(a.f[i] < b.f[i]) << i;
+    return m;
+}
+#endif
+
+// RGBA8, free with stbi_image_free(). Does not need the device.
+static unsigned char *decode_image(const char *filename, int *w, int *h)
+{
+    int n;
+    unsigned char *data = stbi_load(filename, w, h, &n, 4);
+    if (!data)
+        printf("decode_image: %s\n", stbi_failure_reason());
+    return data;
+}
+
+// Same as decode_image() for an image already in memory, safe to call on any thread
+static unsigned char *decode_image_from_memory(const unsigned char *data, size_t size, int *w, int *h)
+{
+    int n;
+    unsigned char *pixels = stbi_load_from_memory(data, int(size), w, h, &n, 4);
+    if (!pixels)
+        printf("decode_image: %s\n", stbi_failure_reason());
+    return pixels;
+}
+
+static bool read_file(const char *filename, std::vector<unsigned char> *out)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s\n", filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    out->resize(size_t(st.st_size));
+    size_t done = 0;
+    while (done < out->size()) {
+        const ssize_t n = read(fd, out->data() + done, out->size() - done);
+        if (n <= 0) {
+            printf("Failed to read %s\n", filename);
+            close(fd);
+            return false;
+        }
+        done += size_t(n);
+    }
+    close(fd);
+    return true;
+}
 
+static WGPUTexture create_texture_rgba8(const unsigned char *data, int w, int h)
+{
     WGPUTextureFormat view_format = WGPUTextureFormat_RGBA8Unorm;
     WGPUTextureDescriptor desc = {
         .usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst,
@@ -316,6 +1983,7 @@ static WGPUTexture rebuild_gui_font_atlas()
         .viewFormats = &view_format
     };
     WGPUTexture texture = wgpuDeviceCreateTexture(d.device, &desc);
+    track_gpu_memory(texture, GpuMemoryCategory::Textures, uint64_t(w) * h * 4);
 
     WGPUImageCopyTexture dst_desc = {
         .texture = texture
@@ -330,51 +1998,512 @@ static WGPUTexture rebuild_gui_font_atlas()
         .height = uint32_t(h),
         .depthOrArrayLayers = 1
     };
-    wgpuQueueWriteTexture(d.queue, &dst_desc, pixels, w * h * 4, &data_layout, &write_size);
+    wgpuQueueWriteTexture(d.queue, &dst_desc, data, w * h * 4, &data_layout, &write_size);
 
     return texture;
 }
 
-static WGPUTexture rebuild_gui_font_atlas_with_font(const char *filename)
+static WGPUTexture load_texture(const char *filename)
 {
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        printf("Failed to open %s\n", filename);
-        return nullptr;
-    }
-    fseek(f, 0, SEEK_END);
-    const long size = ftell(f);
-    if (size < 1) {
-        printf("Failed to get size for file %s\n", filename);
-        fclose(f);
-        return nullptr;
-    }
-    fseek(f, 0, SEEK_SET);
-    std::vector<unsigned char> font(size);
-    if (fread(font.data(), 1, size, f) != size) {
-        printf("Failed to read font file %s\n", filename);
-        fclose(f);
+    int w, h;
+    unsigned char *data = decode_image(filename, &w, &h);
+    if (!data)
         return nullptr;
-    }
-    fclose(f);
-
-    ImGuiIO &io(ImGui::GetIO());
-    ImFontConfig fontCfg;
-    fontCfg.FontDataOwnedByAtlas = false;
-    io.Fonts->Clear();
-    io.Fonts->AddFontFromMemoryTTF(font.data(), font.size(), 20.0f, &fontCfg);
-
-    return rebuild_gui_font_atlas();
+    WGPUTexture texture = create_texture_rgba8(data, w, h);
+    stbi_image_free(data);
+    return texture;
+}
+
+static WGPUTexture rebuild_gui_font_atlas()
+{
+    ImGuiIO &io(ImGui::GetIO());
+    unsigned char *pixels;
+    int w, h;
+    // coverage only, the shader uses it as alpha with white color
+    io.Fonts->GetTexDataAsAlpha8(&pixels, &w, &h);
+
+    WGPUTextureFormat view_format = WGPUTextureFormat_R8Unorm;
+    WGPUTextureDescriptor desc = {
+        .usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst,
+        .dimension = WGPUTextureDimension_2D,
+        .size = {
+            .width = uint32_t(w),
+            .height = uint32_t(h),
+            .depthOrArrayLayers = 1
+        },
+        .format = WGPUTextureFormat_R8Unorm,
+        .mipLevelCount = 1,
+        .sampleCount = 1,
+        .viewFormatCount = 1,
+        .viewFormats = &view_format
+    };
+    WGPUTexture texture = wgpuDeviceCreateTexture(d.device, &desc);
+    track_gpu_memory(texture, GpuMemoryCategory::FontAtlas, uint64_t(w) * h);
+
+    WGPUImageCopyTexture dst_desc = {
+        .texture = texture
+    };
+    WGPUTextureDataLayout data_layout = {
+        .offset = 0,
+        .bytesPerRow = uint32_t(w),
+        .rowsPerImage = uint32_t(h)
+    };
+    WGPUExtent3D write_size = {
+        .width = uint32_t(w),
+        .height = uint32_t(h),
+        .depthOrArrayLayers = 1
+    };
+    wgpuQueueWriteTexture(d.queue, &dst_desc, pixels, w * h, &data_layout, &write_size);
+
+    return texture;
+}
+
+// Writes the distance field for a glyph to dst, clipped to max_w x max_h. Returns the
+// bitmap box (padding included) relative to the glyph origin, or false for empty glyphs.
+static bool rasterize_gui_glyph_sdf(const stbtt_fontinfo *info, float scale, int glyph, unsigned char *dst, int stride,
+                                    int max_w, int max_h, int *x0, int *y0, int *x1, int *y1)
+{
+    int w, h;
+    unsigned char *sdf = stbtt_GetGlyphSDF(info, scale, glyph, GUI_FONT_SDF_PADDING, GUI_FONT_SDF_ON_EDGE,
+                                           float(GUI_FONT_SDF_ON_EDGE) / GUI_FONT_SDF_PADDING, &w, &h, x0, y0);
+    if (!sdf)
+        return false;
+    *x1 = *x0 + std::min(w, max_w);
+    *y1 = *y0 + std::min(h, max_h);
+    for (int row = 0; row < *y1 - *y0; ++row)
+        memcpy(dst + row * stride, sdf + row * w, *x1 - *x0);
+    stbtt_FreeSDF(sdf, nullptr);
+    return true;
+}
+
+static void init_gui_glyph_cache(ImFont *font, const stbtt_fontinfo &font_info, float size_pixels)
+{
+    ImGuiIO &io(ImGui::GetIO());
+    GuiGlyphCache &c(d.gui_glyph_cache);
+    c.font = font;
+    c.font_info = font_info;
+    c.scale = stbtt_ScaleForPixelHeight(&c.font_info, size_pixels);
+    const ImFontAtlasCustomRect *region = io.Fonts->GetCustomRectByIndex(c.region_rect_id);
+    c.region_x = region->X;
+    c.region_y = region->Y;
+    c.cell_size = int(ceilf(size_pixels * 1.25f)) + GUI_FONT_SDF_PADDING * 2 + 1;
+    c.columns = GuiGlyphCache::REGION_WIDTH / c.cell_size;
+    c.cells.assign(c.columns * (GuiGlyphCache::REGION_HEIGHT / c.cell_size), {});
+    c.resident.clear();
+    c.missing.clear();
+    c.requested.clear();
+    c.unavailable.clear();
+}
+
+// Requests the glyphs for some UTF-8 text that is about to be shown
+static void touch_gui_glyphs(const char *text, const char *text_end)
+{
+    GuiGlyphCache &c(d.gui_glyph_cache);
+    if (!c.font)
+        return;
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(text);
+    const uint8_t *end = reinterpret_cast<const uint8_t *>(text_end);
+    while (p < end) {
+        if (end - p >= 16 && !u8x16_high_mask(u8x16_load(p))) {
+            p += 16;
+            continue;
+        }
+        unsigned int cp = *p;
+        int len = 1;
+        if (cp >= 0xF0 && end - p >= 4) {
+            cp = ((cp & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+            len = 4;
+        } else if (cp >= 0xE0 && end - p >= 3) {
+            cp = ((cp & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            len = 3;
+        } else if (cp >= 0xC0 && end - p >= 2) {
+            cp = ((cp & 0x1F) << 6) | (p[1] & 0x3F);
+            len = 2;
+        }
+        p += len;
+        if (cp <= 0xFF || cp > IM_UNICODE_CODEPOINT_MAX)
+            continue;
+        const ImWchar wc = ImWchar(cp);
+        auto it = c.resident.find(wc);
+        if (it != c.resident.end())
+            c.cells[it->second].last_used = c.frame;
+        else if (!c.unavailable.count(wc) && c.requested.insert(wc).second)
+            c.missing.push_back(wc);
+    }
+}
+
+static void upload_gui_font_atlas_rect(int x, int y, int w, int h)
+{
+    ImGuiIO &io(ImGui::GetIO());
+    const int atlas_width = io.Fonts->TexWidth;
+    WGPUImageCopyTexture dst_desc = {
+        .texture = d.gui_font_texture,
+        .origin = {
+            .x = uint32_t(x),
+            .y = uint32_t(y)
+        }
+    };
+    WGPUTextureDataLayout data_layout = {
+        .offset = 0,
+        .bytesPerRow = uint32_t(atlas_width),
+        .rowsPerImage = uint32_t(h)
+    };
+    WGPUExtent3D write_size = {
+        .width = uint32_t(w),
+        .height = uint32_t(h),
+        .depthOrArrayLayers = 1
+    };
+    const unsigned char *src = io.Fonts->TexPixelsAlpha8 + y * atlas_width + x;
+    wgpuQueueWriteTexture(d.queue, &dst_desc, src, (h - 1) * atlas_width + w, &data_layout, &write_size);
+}
+
+// Rasterizes (a limited number of) the glyphs requested since the last frame. Must be
+// called outside of NewFrame/Render since it modifies the font.
+static void update_gui_glyph_cache()
+{
+    ImGuiIO &io(ImGui::GetIO());
+    GuiGlyphCache &c(d.gui_glyph_cache);
+    ++c.frame;
+    if (!c.font || c.missing.empty() || c.cells.empty())
+        return;
+
+    ImFont *font = c.font;
+    const int atlas_width = io.Fonts->TexWidth;
+    const ImVec2 uv_scale = io.Fonts->TexUvScale;
+    const float ascent = floorf(font->Ascent + 0.5f);
+    int n = 0;
+    for (; n < int(c.missing.size()) && n < GuiGlyphCache::MAX_RASTERIZE_PER_FRAME; ++n) {
+        const ImWchar cp = c.missing[n];
+        const int glyph = stbtt_FindGlyphIndex(&c.font_info, cp);
+        if (!glyph) {
+            c.requested.erase(cp);
+            c.unavailable.insert(cp);
+            continue;
+        }
+
+        // a free cell or the least recently used one, but never one drawn in the last frame
+        int cell = -1;
+        for (int i = 0; i < int(c.cells.size()); ++i) {
+            if (!c.cells[i].codepoint) {
+                cell = i;
+                break;
+            }
+            if (c.cells[i].last_used + 1 < c.frame && (cell < 0 || c.cells[i].last_used < c.cells[cell].last_used))
+                cell = i;
+        }
+        if (cell < 0) {
+            // everything resident is on screen: the rest keeps the fallback glyph and is
+            // requested again when drawn, instead of evicting glyphs still in use
+            for (int i = n; i < int(c.missing.size()); ++i)
+                c.requested.erase(c.missing[i]);
+            n = int(c.missing.size());
+            break;
+        }
+        c.requested.erase(cp);
+        if (c.cells[cell].codepoint) {
+            const ImWchar evicted = c.cells[cell].codepoint;
+            for (int i = 0; i < font->Glyphs.Size; ++i) {
+                if (font->Glyphs[i].Codepoint == evicted) {
+                    font->Glyphs.erase(&font->Glyphs[i]);
+                    break;
+                }
+            }
+            c.resident.erase(evicted);
+            ++c.evicted_count;
+        }
+
+        const int x = c.region_x + (cell % c.columns) * c.cell_size;
+        const int y = c.region_y + (cell / c.columns) * c.cell_size;
+        unsigned char *dst = io.Fonts->TexPixelsAlpha8 + y * atlas_width + x;
+        for (int row = 0; row < c.cell_size; ++row)
+            memset(dst + row * atlas_width, 0, c.cell_size);
+
+        int advance, lsb, x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+        stbtt_GetGlyphHMetrics(&c.font_info, glyph, &advance, &lsb);
+        // keep a one pixel border for filtering
+        rasterize_gui_glyph_sdf(&c.font_info, c.scale, glyph, dst, atlas_width, c.cell_size - 1, c.cell_size - 1, &x0, &y0, &x1, &y1);
+        upload_gui_font_atlas_rect(x, y, c.cell_size, c.cell_size);
+
+        const int w = x1 - x0;
+        const int h = y1 - y0;
+        font->AddGlyph(nullptr, cp, float(x0), float(y0) + ascent, float(x1), float(y1) + ascent,
+                       x * uv_scale.x, y * uv_scale.y, (x + w) * uv_scale.x, (y + h) * uv_scale.y, advance * c.scale);
+        c.cells[cell].codepoint = cp;
+        c.cells[cell].last_used = c.frame;
+        c.resident[cp] = cell;
+        ++c.rasterized_count;
+    }
+    c.missing.erase(c.missing.begin(), c.missing.begin() + n);
+    font->BuildLookupTable();
+}
+
+static const FontSource *get_font_source(const char *filename)
+{
+    auto it = d.font_sources.find(filename);
+    if (it != d.font_sources.end())
+        return &it->second;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s\n", filename);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 1) {
+        printf("Failed to get size for file %s\n", filename);
+        close(fd);
+        return nullptr;
+    }
+    FontSource src;
+    src.size = size_t(st.st_size);
+    void *p = mmap(nullptr, src.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+        src.data = static_cast<const unsigned char *>(p);
+        src.mapped = true;
+    } else {
+        // read into the buffer that is kept
+        src.owned.reset(new unsigned char[src.size]);
+        size_t done = 0;
+        while (done < src.size) {
+            const ssize_t n = read(fd, src.owned.get() + done, src.size - done);
+            if (n <= 0) {
+                printf("Failed to read font file %s\n", filename);
+                close(fd);
+                return nullptr;
+            }
+            done += size_t(n);
+        }
+        src.data = src.owned.get();
+    }
+    close(fd);
+    return &(d.font_sources[filename] = std::move(src));
+}
+
+static void release_font_sources()
+{
+    for (auto &it : d.font_sources) {
+        if (it.second.mapped)
+            munmap(const_cast<unsigned char *>(it.second.data), it.second.size);
+    }
+    d.font_sources.clear();
+}
+
+// CPU side only (the texture is created by rebuild_gui_font_atlas()), so this can run
+// before the device exists
+static bool bake_gui_font_atlas(const char *filename)
+{
+    // the glyph cache keeps rasterizing from the source later on
+    const FontSource *font = get_font_source(filename);
+    if (!font)
+        return false;
+
+    stbtt_fontinfo font_info;
+    if (!stbtt_InitFont(&font_info, font->data, stbtt_GetFontOffsetForIndex(font->data, 0))) {
+        printf("Failed to parse font file %s\n", filename);
+        return false;
+    }
+    const float scale = stbtt_ScaleForPixelHeight(&font_info, GUI_FONT_SDF_SIZE);
+    int ascent, descent, line_gap;
+    stbtt_GetFontVMetrics(&font_info, &ascent, &descent, &line_gap);
+    // same rounding as ImGui applies to its own glyphs
+    const float offset_y = floorf(floorf(ascent * scale + 1.0f) + 0.5f);
+
+    ImGuiIO &io(ImGui::GetIO());
+    ImFontConfig fontCfg;
+    fontCfg.FontDataOwnedByAtlas = false;
+    // ImGui only rasterizes coverage, so let it lay out the space glyph only and
+    // bake the rest as distance fields into custom glyph rects
+    static const ImWchar space_range[] = { 0x20, 0x20, 0 };
+    fontCfg.GlyphRanges = space_range;
+    io.Fonts->Clear();
+    // baked anti-aliased lines are coverage too, rely on geometry instead
+    io.Fonts->Flags |= ImFontAtlasFlags_NoBakedLines;
+    io.Fonts->TexDesiredWidth = 1024;
+    ImFont *imfont = io.Fonts->AddFontFromMemoryTTF(const_cast<unsigned char *>(font->data), int(font->size), GUI_FONT_SDF_SIZE, &fontCfg);
+
+    struct BakedGlyph
+    {
+        int rect_id;
+        int glyph;
+    };
+    std::vector<BakedGlyph> baked;
+    for (ImWchar cp = 0x21; cp <= 0xFF; ++cp) {
+        const int glyph = stbtt_FindGlyphIndex(&font_info, cp);
+        if (!glyph)
+            continue;
+        int advance, lsb, x0, y0, x1, y1;
+        stbtt_GetGlyphHMetrics(&font_info, glyph, &advance, &lsb);
+        stbtt_GetGlyphBitmapBox(&font_info, glyph, scale, scale, &x0, &y0, &x1, &y1);
+        if (x0 == x1 || y0 == y1) {
+            x0 = y0 = 0;
+            x1 = y1 = 1 - 2 * GUI_FONT_SDF_PADDING;
+        }
+        const int rect_id = io.Fonts->AddCustomRectFontGlyph(imfont, cp,
+                                                             x1 - x0 + 2 * GUI_FONT_SDF_PADDING, y1 - y0 + 2 * GUI_FONT_SDF_PADDING,
+                                                             advance * scale,
+                                                             ImVec2(x0 - GUI_FONT_SDF_PADDING, y0 - GUI_FONT_SDF_PADDING + offset_y));
+        baked.push_back({ rect_id, glyph });
+    }
+    d.gui_glyph_cache.region_rect_id = io.Fonts->AddCustomRectRegular(GuiGlyphCache::REGION_WIDTH, GuiGlyphCache::REGION_HEIGHT);
+
+    io.Fonts->Build();
+    for (const BakedGlyph &g : baked) {
+        const ImFontAtlasCustomRect *r = io.Fonts->GetCustomRectByIndex(g.rect_id);
+        int x0, y0, x1, y1;
+        rasterize_gui_glyph_sdf(&font_info, scale, g.glyph, io.Fonts->TexPixelsAlpha8 + r->Y * io.Fonts->TexWidth + r->X,
+                                io.Fonts->TexWidth, r->Width, r->Height, &x0, &y0, &x1, &y1);
+    }
+    // layout happens at the requested size, the atlas stays at the SDF size
+    imfont->Scale = GUI_FONT_SIZE / GUI_FONT_SDF_SIZE;
+
+    init_gui_glyph_cache(imfont, font_info, GUI_FONT_SDF_SIZE);
+    return true;
+}
+
+static uint8_t input_mods(EM_BOOL ctrl, EM_BOOL shift, EM_BOOL alt, EM_BOOL meta)
+{
+    return (ctrl ? INPUT_MOD_CTRL : 0) | (shift ? INPUT_MOD_SHIFT : 0) | (alt ? INPUT_MOD_ALT : 0) | (meta ? INPUT_MOD_SUPER : 0);
+}
+
+// Only the modifiers that changed since the last event
+static void apply_input_mods(ImGuiIO &io, uint8_t mods)
+{
+    const uint32_t changed = d.input_stats.mods ^ mods;
+    if (changed & INPUT_MOD_CTRL)
+        io.AddKeyEvent(ImGuiKey_ModCtrl, mods & INPUT_MOD_CTRL);
+    if (changed & INPUT_MOD_SHIFT)
+        io.AddKeyEvent(ImGuiKey_ModShift, mods & INPUT_MOD_SHIFT);
+    if (changed & INPUT_MOD_ALT)
+        io.AddKeyEvent(ImGuiKey_ModAlt, mods & INPUT_MOD_ALT);
+    if (changed & INPUT_MOD_SUPER)
+        io.AddKeyEvent(ImGuiKey_ModSuper, mods & INPUT_MOD_SUPER);
+    d.input_stats.mods = mods;
+}
+
+static void apply_input_event(const InputEvent &e)
+{
+    ImGuiIO &io(ImGui::GetIO());
+    ++d.input_stats.applied;
+    switch (e.type) {
+    case InputEventType::MouseMove:
+        io.AddMousePosEvent(e.x, e.y);
+        break;
+    case InputEventType::MouseButton:
+        apply_input_mods(io, e.mods);
+        if (e.button >= 0)
+            io.AddMouseButtonEvent(e.button, e.down);
+        break;
+    case InputEventType::Wheel:
+        io.AddMouseWheelEvent(e.x, e.y);
+        break;
+    case InputEventType::Key:
+        apply_input_mods(io, e.mods);
+        io.AddKeyEvent(e.key, e.down);
+        break;
+    case InputEventType::Char:
+        apply_input_mods(io, e.mods);
+        io.AddInputCharactersUTF8(e.text);
+        touch_gui_glyphs(e.text, e.text + strlen(e.text));
+        break;
+    }
+}
+
+// Hands everything that arrived since the last frame to ImGui, in order, except that mouse
+// moves are merged into the last position before the next other event and consecutive
+// wheel events into one
+static void drain_input_events()
+{
+    InputStats &stats(d.input_stats);
+    const uint32_t applied_before = stats.applied;
+    uint32_t raw = 0;
+    double oldest = 0.0;
+    InputEvent move;
+    bool have_move = false;
+    InputEvent wheel;
+    bool have_wheel = false;
+    InputEvent e;
+    while (d.input_ring.pop(&e)) {
+        if (!raw++)
+            oldest = e.time;
+        if (e.type == InputEventType::MouseMove) {
+            // a wheel event before the move stays before it
+            if (have_wheel) {
+                apply_input_event(wheel);
+                have_wheel = false;
+            }
+            move = e;
+            have_move = true;
+            continue;
+        }
+        if (have_move) {
+            apply_input_event(move);
+            have_move = false;
+        }
+        if (e.type == InputEventType::Wheel) {
+            if (have_wheel) {
+                wheel.x += e.x;
+                wheel.y += e.y;
+            } else {
+                wheel = e;
+                have_wheel = true;
+            }
+            continue;
+        }
+        if (have_wheel) {
+            apply_input_event(wheel);
+            have_wheel = false;
+        }
+        apply_input_event(e);
+    }
+    if (have_move)
+        apply_input_event(move);
+    if (have_wheel)
+        apply_input_event(wheel);
+    stats.last_frame_raw = raw;
+    stats.last_frame_applied = stats.applied - applied_before;
+    stats.frame_input_time = oldest;
+}
+
+// Called from the DOM event callbacks
+static void handle_input_event(InputEvent e)
+{
+    e.time = emscripten_get_now();
+    d.input_ring.push(e);
+}
+
+// After submitting a frame, gpu_done_time is filled in once the GPU has finished it
+static void record_input_latency(uint32_t frame, double submit_time)
+{
+    InputStats &stats(d.input_stats);
+    auto &f(stats.inflight[frame % INPUT_INFLIGHT_FRAMES]);
+    f.frame = frame;
+    f.input_time = stats.frame_input_time;
+    f.submit_ms = stats.frame_input_time ? submit_time - stats.frame_input_time : 0.0;
+}
+
+static void input_frame_done(uint32_t frame, double gpu_done_time)
+{
+    InputStats &stats(d.input_stats);
+    const auto &f(stats.inflight[frame % INPUT_INFLIGHT_FRAMES]);
+    if (f.frame != frame || !f.input_time)
+        return;
+    const int i = stats.sample_count++ % INPUT_LATENCY_SAMPLE_COUNT;
+    stats.submit_ms[i] = float(f.submit_ms);
+    stats.gpu_done_ms[i] = float(gpu_done_time - f.input_time);
 }
 
 static void next_gui_frame()
 {
     ImGuiIO &io(ImGui::GetIO());
 
+    drain_input_events();
+
     io.DisplaySize.x = d.win_size.width;
     io.DisplaySize.y = d.win_size.height;
     io.DisplayFramebufferScale = ImVec2(d.dpr, d.dpr);
 
+    update_gui_glyph_cache();
+
     ImGui::NewFrame();
     d.scene.gui();
     ImGui::Render();
@@ -382,8 +2511,10 @@ static void next_gui_frame()
     ImDrawData *draw = ImGui::GetDrawData();
     d.gui_buf_offsets.clear();
     d.gui_buf_offsets.reserve(draw->CmdListsCount);
-    std::vector<ImDrawVert> vbuf_data;
-    std::vector<ImDrawIdx> ibuf_data;
+    FrameVector<ImDrawVert> vbuf_data;
+    FrameVector<ImDrawIdx> ibuf_data;
+    vbuf_data.reserve(draw->TotalVtxCount);
+    ibuf_data.reserve(draw->TotalIdxCount);
     uint32_t vbuf_total_byte_size = 0;
     uint32_t ibuf_total_byte_size = 0;
     for (int n = 0; n < draw->CmdListsCount; ++n) {
@@ -402,20 +2533,17 @@ static void next_gui_frame()
         });
     }
 
-    if (d.gui_vbuf && wgpuBufferGetSize(d.gui_vbuf) < vbuf_total_byte_size) {
-        wgpuBufferDestroy(d.gui_vbuf);
-        d.gui_vbuf = nullptr;
-    }
+    // the old buffers may still be used by the previous frames, releases are deferred
+    if (d.gui_vbuf && wgpuBufferGetSize(d.gui_vbuf) < vbuf_total_byte_size)
+        d.gui_vbuf.reset();
 
     if (!d.gui_vbuf)
         d.gui_vbuf = create_buffer_with_data(WGPUBufferUsage_Vertex | WGPUBufferUsage_CopyDst, vbuf_total_byte_size, vbuf_data.data());
     else
         wgpuQueueWriteBuffer(d.queue, d.gui_vbuf, 0, vbuf_data.data(), vbuf_total_byte_size);
 
-    if (d.gui_ibuf && wgpuBufferGetSize(d.gui_ibuf) < ibuf_total_byte_size) {
-        wgpuBufferDestroy(d.gui_ibuf);
-        d.gui_ibuf = nullptr;
-    }
+    if (d.gui_ibuf && wgpuBufferGetSize(d.gui_ibuf) < ibuf_total_byte_size)
+        d.gui_ibuf.reset();
 
     if (!d.gui_ibuf)
         d.gui_ibuf = create_buffer_with_data(WGPUBufferUsage_Index | WGPUBufferUsage_CopyDst, ibuf_total_byte_size, ibuf_data.data());
@@ -454,37 +2582,94 @@ bool clamp_scissor(const Size &renderTargetPixelSize, T *x, T *y, T *w, T *h)
     return true;
 }
 
-static void render_gui(WGPURenderPassEncoder pass)
+static WGPUBindGroup get_gui_bind_group(WGPUTextureView view)
+{
+    GpuHandle<WGPUBindGroup> &bg(d.gui_bg_cache[view]);
+    if (!bg) {
+        WGPUBindGroupEntry bg_entries[] = {
+            {
+                .binding = 0,
+                .buffer = d.gui_ubuf,
+                .size = 64,
+            },
+            {
+                .binding = 1,
+                .textureView = view
+            },
+            {
+                .binding = 2,
+                .sampler = d.gui_sampler
+            }
+        };
+        WGPUBindGroupDescriptor bg_desc = {
+            .layout = d.gui_bgl,
+            .entryCount = 3,
+            .entries = bg_entries
+        };
+        bg = wgpuDeviceCreateBindGroup(d.device, &bg_desc);
+    }
+    return bg;
+}
+
+// Must be called before releasing a texture view that was passed to ImGui::Image()
+static void forget_gui_texture(WGPUTextureView view)
+{
+    auto it = d.gui_bg_cache.find(view);
+    if (it != d.gui_bg_cache.end())
+        d.gui_bg_cache.erase(it);
+}
+
+static void draw_gui(WGPURenderPassEncoder pass, WGPURenderPipeline font_ps, WGPURenderPipeline image_ps)
 {
     ImDrawData *draw = ImGui::GetDrawData();
     draw->ScaleClipRects(ImVec2(d.dpr, d.dpr));
 
+    ImTextureID current_texture = nullptr;
     for (int n = 0; n < draw->CmdListsCount; ++n) {
         const ImDrawList *cmd_list = draw->CmdLists[n];
-        const ImDrawIdx *index_buf_offset = nullptr;
+        wgpuRenderPassEncoderSetVertexBuffer(pass, 0, d.gui_vbuf, d.gui_buf_offsets[n].v_offset, d.gui_buf_offsets[n].v_size);
+        wgpuRenderPassEncoderSetIndexBuffer(pass, d.gui_ibuf, WGPUIndexFormat_Uint32, d.gui_buf_offsets[n].i_offset, d.gui_buf_offsets[n].i_size);
+        uint32_t first_index = 0;
         for (int i = 0; i < cmd_list->CmdBuffer.Size; ++i) {
             const ImDrawCmd *cmd = &cmd_list->CmdBuffer[i];
             if (!cmd->UserCallback) {
-                const uint32_t index_offset = d.gui_buf_offsets[n].i_offset + uintptr_t(index_buf_offset);
                 float sx = cmd->ClipRect.x;
                 float sy = cmd->ClipRect.y;
                 float sw = cmd->ClipRect.z - cmd->ClipRect.x;
                 float sh = cmd->ClipRect.w - cmd->ClipRect.y;
                 if (clamp_scissor(d.fb_size, &sx, &sy, &sw, &sh))
                     wgpuRenderPassEncoderSetScissorRect(pass, sx, sy, sw, sh);
-                wgpuRenderPassEncoderSetPipeline(pass, d.gui_ps);
-                wgpuRenderPassEncoderSetVertexBuffer(pass, 0, d.gui_vbuf, d.gui_buf_offsets[n].v_offset, d.gui_buf_offsets[n].v_size);
-                wgpuRenderPassEncoderSetIndexBuffer(pass, d.gui_ibuf, WGPUIndexFormat_Uint32, index_offset, cmd->ElemCount * 4);
-                wgpuRenderPassEncoderSetBindGroup(pass, 0, d.gui_bg, 0, nullptr);
-                wgpuRenderPassEncoderDrawIndexed(pass, cmd->ElemCount, 1, 0, 0, 0);
+                // only rebind when the texture changes, text and images typically come in runs
+                const ImTextureID texture = cmd->GetTexID();
+                const bool is_font = texture == ImTextureID(d.gui_font_texture_view);
+                // images are skipped while their pipeline is still being created
+                if (is_font || image_ps) {
+                    if (texture != current_texture) {
+                        if (!current_texture || is_font != (current_texture == ImTextureID(d.gui_font_texture_view)))
+                            wgpuRenderPassEncoderSetPipeline(pass, is_font ? font_ps : image_ps);
+                        wgpuRenderPassEncoderSetBindGroup(pass, 0, get_gui_bind_group(WGPUTextureView(texture)), 0, nullptr);
+                        current_texture = texture;
+                    }
+                    wgpuRenderPassEncoderDrawIndexed(pass, cmd->ElemCount, 1, first_index, 0, 0);
+                }
             } else {
                 cmd->UserCallback(cmd_list, cmd);
+                // the callback may have changed any state
+                current_texture = nullptr;
             }
-            index_buf_offset += cmd->ElemCount;
+            first_index += cmd->ElemCount;
         }
     }
 }
 
+// Draws the GUI on top of the scene. When the scene is rendered offscreen, the GUI is drawn
+// in the blit pass instead (see blit_color_target()), so this does nothing.
+static void render_gui(WGPURenderPassEncoder pass)
+{
+    if (!d.color_target_view)
+        draw_gui(pass, d.gui_ps, d.gui_image_ps);
+}
+
 static void init_gui_renderer()
 {
     static const char *shaders = R"end(
@@ -511,7 +2696,11 @@ static void init_gui_renderer()
     @group(0) @binding(2) var samp : sampler;
 
     @fragment fn f_main(@location(0) uv : vec2<f32>, @location(1) color : vec4<f32>) -> @location(0) vec4<f32> {
-        var c = color * textureSample(tex, samp, uv);
+        // the font atlas is an R8 distance field (solid areas are 1.0, so the white
+        // pixel works as well), antialias the 0.5 outline over about one screen pixel
+        var dist = textureSample(tex, samp, uv).r;
+        var width = max(fwidth(dist), 0.0001);
+        var c = color * vec4<f32>(1.0, 1.0, 1.0, clamp((dist - 0.5) / width + 0.5, 0.0, 1.0));
         // ???!!!
         // c.rgb *= c.a;
         c.r *= c.a;
@@ -519,19 +2708,29 @@ static void init_gui_renderer()
         c.b *= c.a;
         return c;
     }
+
+    @fragment fn f_image(@location(0) uv : vec2<f32>, @location(1) color : vec4<f32>) -> @location(0) vec4<f32> {
+        var c = color * textureSample(tex, samp, uv);
+        c.r *= c.a;
+        c.g *= c.a;
+        c.b *= c.a;
+        return c;
+    }
     )end";
 
     d.gui_shader_module = create_shader_module(shaders);
 
-    d.gui_font_texture = rebuild_gui_font_atlas_with_font("RobotoMono-Medium.ttf");
+    // baked by main() while the device was being requested
+    d.gui_font_texture = rebuild_gui_font_atlas();
 
     WGPUTextureViewDescriptor view_desc = {
-        .format = WGPUTextureFormat_RGBA8Unorm,
+        .format = WGPUTextureFormat_R8Unorm,
         .dimension = WGPUTextureViewDimension_2D,
         .mipLevelCount = 1,
         .arrayLayerCount = 1
     };
     d.gui_font_texture_view = wgpuTextureCreateView(d.gui_font_texture, &view_desc);
+    ImGui::GetIO().Fonts->SetTexID(ImTextureID(d.gui_font_texture_view));
 
     WGPUSamplerDescriptor samplerDesc = {
         .addressModeU = WGPUAddressMode_Repeat,
@@ -574,12 +2773,12 @@ static void init_gui_renderer()
 
     WGPUPipelineLayoutDescriptor pl_desc = {
         .bindGroupLayoutCount = 1,
-        .bindGroupLayouts = &d.gui_bgl
+        .bindGroupLayouts = d.gui_bgl.ptr()
     };
     d.gui_pl = wgpuDeviceCreatePipelineLayout(d.device, &pl_desc);
 
     WGPUDepthStencilState ds_state = {
-        .format = WGPUTextureFormat_Depth24PlusStencil8,
+        .format = DEPTH_FORMAT,
         .depthWriteEnabled = false,
         .depthCompare = WGPUCompareFunction_Less
     };
@@ -648,31 +2847,20 @@ static void init_gui_renderer()
         },
         .fragment = &fs
     };
-    d.gui_ps = wgpuDeviceCreateRenderPipeline(d.device, &ps_desc);
+    d.gui_ps = create_render_pipeline(ps_desc);
 
-    d.gui_ubuf = create_uniform_buffer(64);
+    // images are not needed on the first frame, the font pipeline is
+    fs.entryPoint = "f_image";
+    create_render_pipeline_async(ps_desc, [](WGPURenderPipeline ps) { d.gui_image_ps = ps; });
 
-    WGPUBindGroupEntry bg_entries[] = {
-        {
-            .binding = 0,
-            .buffer = d.gui_ubuf,
-            .size = 64,
-        },
-        {
-            .binding = 1,
-            .textureView = d.gui_font_texture_view
-        },
-        {
-            .binding = 2,
-            .sampler = d.gui_sampler
-        }
-    };
-    WGPUBindGroupDescriptor bg_desc = {
-        .layout = d.gui_bgl,
-        .entryCount = 3,
-        .entries = bg_entries
-    };
-    d.gui_bg = wgpuDeviceCreateBindGroup(d.device, &bg_desc);
+    // neither are the variants for the blit pass, which has no depth attachment
+    ps_desc.depthStencil = nullptr;
+    fs.entryPoint = "f_main";
+    create_render_pipeline_async(ps_desc, [](WGPURenderPipeline ps) { d.gui_blit_ps = ps; });
+    fs.entryPoint = "f_image";
+    create_render_pipeline_async(ps_desc, [](WGPURenderPipeline ps) { d.gui_blit_image_ps = ps; });
+
+    d.gui_ubuf = create_uniform_buffer(64);
 }
 
 static void update_size()
@@ -688,8 +2876,6 @@ static void update_size()
     d.dpr = float(dpr);
 
     emscripten_set_canvas_element_size("#canvas", d.fb_size.width, d.fb_size.height);
-
-    printf("size: win %dx%d fb %dx%d dpr %f\n", d.win_size.width, d.win_size.height, d.fb_size.width, d.fb_size.height, d.dpr);
 }
 
 static EM_BOOL size_changed(int event_type, const EmscriptenUiEvent *ui_event, void *user_data)
@@ -697,7 +2883,8 @@ static EM_BOOL size_changed(int event_type, const EmscriptenUiEvent *ui_event, v
     if (d.quit)
         return false;
 
-    update_size();
+    // handled once in the next frame, no matter how many events arrive until then
+    d.size_dirty = true;
     return true;
 }
 
@@ -706,48 +2893,42 @@ static EM_BOOL mouse_callback(int emsc_type, const EmscriptenMouseEvent *emsc_ev
     if (d.quit)
         return false;
 
-    ImGuiIO &io(ImGui::GetIO());
-    const float x = float(emsc_event->targetX);
-    const float y = float(emsc_event->targetY);
+    InputEvent e = {};
+    e.x = float(emsc_event->targetX);
+    e.y = float(emsc_event->targetY);
 
-    switch (emsc_type) {
-    case EMSCRIPTEN_EVENT_MOUSEMOVE:
-        io.AddMousePosEvent(x, y);
+    if (emsc_type == EMSCRIPTEN_EVENT_MOUSEMOVE) {
+        e.type = InputEventType::MouseMove;
+        handle_input_event(e);
         return true;
-    case EMSCRIPTEN_EVENT_MOUSEENTER:
-        break;
-    case EMSCRIPTEN_EVENT_MOUSELEAVE:
-        break;
-    default:
-        break;
     }
 
     if (emsc_event->button >= 0 && emsc_event->button <= 2) {
-        io.AddKeyEvent(ImGuiKey_ModCtrl, emsc_event->ctrlKey);
-        io.AddKeyEvent(ImGuiKey_ModShift, emsc_event->shiftKey);
-        io.AddKeyEvent(ImGuiKey_ModAlt, emsc_event->altKey);
-        io.AddKeyEvent(ImGuiKey_ModSuper, emsc_event->metaKey);
-        int imgui_button = 0;
+        e.type = InputEventType::MouseButton;
+        e.mods = input_mods(emsc_event->ctrlKey, emsc_event->shiftKey, emsc_event->altKey, emsc_event->metaKey);
         switch (emsc_event->button) {
         case 1:
-            imgui_button = 2;
+            e.button = 2;
             break;
         case 2:
-            imgui_button = 1;
+            e.button = 1;
             break;
         default:
+            e.button = 0;
             break;
         }
         switch (emsc_type) {
         case EMSCRIPTEN_EVENT_MOUSEDOWN:
-            io.AddMouseButtonEvent(imgui_button, true);
+            e.down = true;
             break;
         case EMSCRIPTEN_EVENT_MOUSEUP:
-            io.AddMouseButtonEvent(imgui_button, false);
+            e.down = false;
             break;
         default:
+            e.button = -1; // enter, leave
             break;
         }
+        handle_input_event(e);
     }
 
     return true;
@@ -758,10 +2939,11 @@ static EM_BOOL wheel_callback(int emsc_type, const EmscriptenWheelEvent *emsc_ev
     if (d.quit)
         return false;
 
-    ImGuiIO &io(ImGui::GetIO());
-    const float x = float(emsc_event->deltaX / 120.0f);
-    const float y = float(emsc_event->deltaY / -120.0f);
-    io.AddMouseWheelEvent(x, y);
+    InputEvent e = {};
+    e.type = InputEventType::Wheel;
+    e.x = float(emsc_event->deltaX / 120.0f);
+    e.y = float(emsc_event->deltaY / -120.0f);
+    handle_input_event(e);
     return true;
 }
 
@@ -1015,108 +3197,421 @@ static EM_BOOL key_callback(int emsc_type, const EmscriptenKeyboardEvent *emsc_e
     if (d.quit)
         return false;
 
-    ImGuiIO &io(ImGui::GetIO());
-    io.AddKeyEvent(ImGuiKey_ModCtrl, emsc_event->ctrlKey);
-    io.AddKeyEvent(ImGuiKey_ModShift, emsc_event->shiftKey);
-    io.AddKeyEvent(ImGuiKey_ModAlt, emsc_event->altKey);
-    io.AddKeyEvent(ImGuiKey_ModSuper, emsc_event->metaKey);
-
+    // the return value decides whether the browser gets the event as well, so this part
+    // cannot wait for the frame
+    InputEvent e = {};
+    e.mods = input_mods(emsc_event->ctrlKey, emsc_event->shiftKey, emsc_event->altKey, emsc_event->metaKey);
     bool consume = false;
     switch (emsc_type) {
     case EMSCRIPTEN_EVENT_KEYDOWN:
-        io.AddKeyEvent(mapKey(emsc_event->keyCode, &consume), true);
-        break;
     case EMSCRIPTEN_EVENT_KEYUP:
-        io.AddKeyEvent(mapKey(emsc_event->keyCode, &consume), false);
+        e.type = InputEventType::Key;
+        e.key = mapKey(emsc_event->keyCode, &consume);
+        e.down = emsc_type == EMSCRIPTEN_EVENT_KEYDOWN;
         break;
     case EMSCRIPTEN_EVENT_KEYPRESS:
-        if (strlen(emsc_event->key))
-            io.AddInputCharactersUTF8(emsc_event->key);
+        e.type = InputEventType::Char;
+        strncpy(e.text, emsc_event->key, sizeof(e.text) - 1);
         break;
     default:
-        break;
+        return false;
     }
+    handle_input_event(e);
     return consume;
 }
 
-static void ensure_attachments()
+static uint64_t attachment_byte_size(WGPUTextureFormat format, const Size &size)
 {
-    if (d.ds && d.ds_view && d.attachments_size == d.fb_size)
-        return;
+    // an estimate for the depth formats, the actual layout is up to the implementation
+    const uint64_t bytes_per_pixel = format == WGPUTextureFormat_Depth24PlusStencil8 ? 5 : 4;
+    return bytes_per_pixel * size.width * size.height;
+}
 
-    releaseAndNull(d.ds_view);
-    releaseAndNull(d.ds);
+static void release_pooled_attachment(PooledAttachment *a)
+{
+    if (a->view == d.blit_bg_view) {
+        d.blit_bg.reset();
+        d.blit_bg_view = nullptr;
+    }
+    d.attachment_stats.pooled_bytes -= attachment_byte_size(a->format, a->size);
+    a->view.reset();
+    a->texture.reset();
+}
 
-    d.attachments_size = d.fb_size;
+// Returns a view owned by the pool, valid until the end of the frame
+static WGPUTextureView acquire_attachment(WGPUTextureFormat format, const Size &size)
+{
+    for (PooledAttachment &a : d.attachment_pool) {
+        if (a.format == format && a.size == size && a.last_used_frame != d.frame_count) {
+            a.last_used_frame = d.frame_count;
+            return a.view;
+        }
+    }
 
+    const bool is_depth = format == DEPTH_FORMAT;
     WGPUTextureDescriptor desc = {
-        .usage = WGPUTextureUsage_RenderAttachment,
+        .usage = is_depth ? WGPUTextureUsage_RenderAttachment : WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_TextureBinding,
         .dimension = WGPUTextureDimension_2D,
         .size = {
-            .width = d.attachments_size.width,
-            .height = d.attachments_size.height,
+            .width = size.width,
+            .height = size.height,
             .depthOrArrayLayers = 1
         },
-        .format = WGPUTextureFormat_Depth24PlusStencil8,
+        .format = format,
         .mipLevelCount = 1,
         .sampleCount = 1
     };
-    d.ds = wgpuDeviceCreateTexture(d.device, &desc);
-    d.ds_view = wgpuTextureCreateView(d.ds, nullptr);
-
-    printf("Created depth-stencil %dx%d (%p, %p)\n", d.attachments_size.width, d.attachments_size.height, d.ds, d.ds_view);
+    d.attachment_pool.emplace_back();
+    PooledAttachment &a(d.attachment_pool.back());
+    a.texture = wgpuDeviceCreateTexture(d.device, &desc);
+    a.view = wgpuTextureCreateView(a.texture, nullptr);
+    a.format = format;
+    a.size = size;
+    a.last_used_frame = d.frame_count;
+
+    const uint64_t bytes = attachment_byte_size(format, size);
+    track_gpu_memory(a.texture, GpuMemoryCategory::Attachments, bytes);
+    ++d.attachment_stats.allocations;
+    d.attachment_stats.allocated_bytes += bytes;
+    d.attachment_stats.pooled_bytes += bytes;
+    if (LOG_GPU_OBJECT_CREATION)
+        printf("Created %s attachment %dx%d (%p, %p)\n", is_depth ? "depth" : "color", size.width, size.height, a.texture.get(), a.view.get());
+    return a.view;
 }
 
-static void begin_frame()
+// Returns true when something was released
+static bool trim_attachment_pool(uint32_t max_idle_frames = ATTACHMENT_MAX_IDLE_FRAMES)
 {
-    releaseAndNull(d.backbuffer);
-    d.backbuffer = wgpuSwapChainGetCurrentTextureView(d.swapchain);
-    ensure_attachments();
-    d.res_encoder = wgpuDeviceCreateCommandEncoder(d.device, nullptr);
-    d.render_encoder = wgpuDeviceCreateCommandEncoder(d.device, nullptr);
+    bool trimmed = false;
+    for (size_t i = 0; i < d.attachment_pool.size(); ) {
+        if (d.frame_count - d.attachment_pool[i].last_used_frame > max_idle_frames) {
+            release_pooled_attachment(&d.attachment_pool[i]);
+            d.attachment_pool[i] = std::move(d.attachment_pool.back());
+            d.attachment_pool.pop_back();
+            trimmed = true;
+        } else {
+            ++i;
+        }
+    }
+    return trimmed;
 }
 
-static void end_frame()
+static void ensure_attachments()
 {
-    for (WGPUBuffer buf : d.active_ubuf_staging_buffers)
-        wgpuBufferUnmap(buf);
+    ++d.frame_count;
+    if (d.fb_size != d.last_frame_fb_size) {
+        // the initial size is not a resize
+        if (d.last_frame_fb_size.width)
+            d.last_resize_frame = d.frame_count;
+        d.last_frame_fb_size = d.fb_size;
+    }
+    if (d.last_resize_frame && d.frame_count - d.last_resize_frame == RESIZE_SETTLE_FRAMES)
+        printf("Resized to %dx%d (dpr %f)\n", d.fb_size.width, d.fb_size.height, d.dpr);
 
-    WGPUCommandBuffer res_cb = wgpuCommandEncoderFinish(d.res_encoder, nullptr);
-    releaseAndNull(d.res_encoder);
+    const float scale = d.dynamic_resolution.enabled ? d.dynamic_resolution.scale : 1.0f;
+    const Size scaled_size = {
+        std::max(1u, uint32_t(roundf(d.fb_size.width * scale))),
+        std::max(1u, uint32_t(roundf(d.fb_size.height * scale)))
+    };
 
-    WGPUCommandBuffer render_cb = wgpuCommandEncoderFinish(d.render_encoder, nullptr);
-    releaseAndNull(d.render_encoder);
+    // the blit pipelines are not needed until the first resize (or scaling), until then render directly
+    const bool offscreen_ready = d.blit_ps && d.gui_blit_ps;
+    const bool resizing = d.last_resize_frame && d.frame_count - d.last_resize_frame < RESIZE_SETTLE_FRAMES;
+    if (offscreen_ready && (resizing || scaled_size != d.fb_size)) {
+        d.render_size = scaled_size;
+        if (resizing) {
+            // keep the current size as long as the scene fits, shrinking waits until resizing ends
+            if (!d.color_target_view || d.attachments_size.width < d.render_size.width || d.attachments_size.height < d.render_size.height) {
+                d.attachments_size.width = (d.render_size.width + ATTACHMENT_SIZE_BUCKET - 1) / ATTACHMENT_SIZE_BUCKET * ATTACHMENT_SIZE_BUCKET;
+                d.attachments_size.height = (d.render_size.height + ATTACHMENT_SIZE_BUCKET - 1) / ATTACHMENT_SIZE_BUCKET * ATTACHMENT_SIZE_BUCKET;
+            }
+        } else {
+            d.attachments_size = d.render_size;
+        }
+        d.color_target_view = acquire_attachment(WGPUTextureFormat_BGRA8Unorm, d.attachments_size);
+    } else {
+        d.render_size = d.fb_size;
+        d.attachments_size = d.fb_size;
+        d.color_target_view = nullptr;
+    }
+    d.ds_view = acquire_attachment(DEPTH_FORMAT, d.attachments_size);
 
-    WGPUCommandBuffer cbs[] = { res_cb, render_cb };
-    wgpuQueueSubmit(d.queue, 2, cbs);
+    trim_attachment_pool();
+}
+
+static void release_attachments()
+{
+    for (PooledAttachment &a : d.attachment_pool)
+        release_pooled_attachment(&a);
+    d.attachment_pool.clear();
+    d.color_target_view = nullptr;
+    d.ds_view = nullptr;
+}
+
+// Scales the render_size part of the offscreen color target to the backbuffer, then draws the GUI
+static void blit_color_target()
+{
+    if (d.blit_bg_view != d.color_target_view) {
+        d.blit_bg.reset();
+        WGPUBindGroupEntry bg_entries[] = {
+            {
+                .binding = 0,
+                .textureView = d.color_target_view
+            },
+            {
+                .binding = 1,
+                .sampler = d.blit_sampler
+            },
+            {
+                .binding = 2,
+                .buffer = d.blit_ubuf,
+                .size = 16
+            }
+        };
+        WGPUBindGroupDescriptor bg_desc = {
+            .layout = d.blit_bgl,
+            .entryCount = 3,
+            .entries = bg_entries
+        };
+        d.blit_bg = wgpuDeviceCreateBindGroup(d.device, &bg_desc);
+        d.blit_bg_view = d.color_target_view;
+    }
+    if (d.blit_ubuf_render_size != d.render_size || d.blit_ubuf_fb_size != d.fb_size) {
+        const float sizes[4] = { float(d.render_size.width), float(d.render_size.height), float(d.fb_size.width), float(d.fb_size.height) };
+        wgpuQueueWriteBuffer(d.queue, d.blit_ubuf, 0, sizes, sizeof(sizes));
+        d.blit_ubuf_render_size = d.render_size;
+        d.blit_ubuf_fb_size = d.fb_size;
+    }
+
+    WGPURenderPassColorAttachment attachment = {
+        .view = d.backbuffer,
+        .loadOp = WGPULoadOp_Clear,
+        .storeOp = WGPUStoreOp_Store
+    };
+    WGPURenderPassDescriptor renderpass = {
+        .colorAttachmentCount = 1,
+        .colorAttachments = &attachment
+    };
+    WGPURenderPassEncoder pass = wgpuCommandEncoderBeginRenderPass(d.render_encoder, &renderpass);
+    wgpuRenderPassEncoderSetPipeline(pass, d.blit_ps);
+    wgpuRenderPassEncoderSetBindGroup(pass, 0, d.blit_bg, 0, nullptr);
+    wgpuRenderPassEncoderDraw(pass, 3, 1, 0, 0);
+    draw_gui(pass, d.gui_blit_ps, d.gui_blit_image_ps);
+    wgpuRenderPassEncoderEnd(pass);
+    wgpuRenderPassEncoderRelease(pass);
+}
+
+static void init_blit()
+{
+    static const char *shaders = R"end(
+    @vertex fn v_main(@builtin(vertex_index) index : u32) -> @builtin(position) vec4<f32> {
+        // one triangle covering the viewport
+        var uv = vec2<f32>(f32((index << 1u) & 2u), f32(index & 2u));
+        return vec4<f32>(uv * 2.0 - 1.0, 0.0, 1.0);
+    }
+
+    struct Uniforms {
+        render_size : vec2<f32>,
+        fb_size : vec2<f32>
+    }
+    @group(0) @binding(0) var tex : texture_2d<f32>;
+    @group(0) @binding(1) var samp : sampler;
+    @group(0) @binding(2) var<uniform> u : Uniforms;
+
+    @fragment fn f_main(@builtin(position) position : vec4<f32>) -> @location(0) vec4<f32> {
+        // the scene covers the top left render_size part of the texture, at the same
+        // size this samples exactly at texel centers
+        var uv = position.xy / u.fb_size * u.render_size / vec2<f32>(textureDimensions(tex));
+        return textureSample(tex, samp, uv);
+    }
+    )end";
+
+    WGPUBindGroupLayoutEntry bgl_entries[] = {
+        {
+            .binding = 0,
+            .visibility = WGPUShaderStage_Fragment,
+            .texture = {
+                .sampleType = WGPUTextureSampleType_Float,
+                .viewDimension = WGPUTextureViewDimension_2D
+            }
+        },
+        {
+            .binding = 1,
+            .visibility = WGPUShaderStage_Fragment,
+            .sampler {
+                .type = WGPUSamplerBindingType_Filtering
+            }
+        },
+        {
+            .binding = 2,
+            .visibility = WGPUShaderStage_Fragment,
+            .buffer = {
+                .type = WGPUBufferBindingType_Uniform,
+                .minBindingSize = 16
+            }
+        }
+    };
+    WGPUBindGroupLayoutDescriptor bgl_desc = {
+        .entryCount = 3,
+        .entries = bgl_entries
+    };
+    d.blit_bgl = wgpuDeviceCreateBindGroupLayout(d.device, &bgl_desc);
+
+    WGPUPipelineLayoutDescriptor pl_desc = {
+        .bindGroupLayoutCount = 1,
+        .bindGroupLayouts = d.blit_bgl.ptr()
+    };
+    d.blit_pl = wgpuDeviceCreatePipelineLayout(d.device, &pl_desc);
+
+    WGPUShaderModule shader_module = create_shader_module(shaders);
+
+    WGPUColorTargetState color0 = {
+        .format = WGPUTextureFormat_BGRA8Unorm,
+        .writeMask = WGPUColorWriteMask_All
+    };
+
+    WGPUFragmentState fs = {
+        .module = shader_module,
+        .entryPoint = "f_main",
+        .targetCount = 1,
+        .targets = &color0
+    };
+
+    WGPURenderPipelineDescriptor ps_desc = {
+        .layout = d.blit_pl,
+        .vertex = {
+            .module = shader_module,
+            .entryPoint = "v_main"
+        },
+        .primitive = {
+            .topology = WGPUPrimitiveTopology_TriangleList
+        },
+        .multisample = {
+            .count = 1,
+            .mask = 0xFFFFFFFF
+        },
+        .fragment = &fs
+    };
+    // only needed once the window gets resized
+    create_render_pipeline_async(ps_desc, [](WGPURenderPipeline ps) { d.blit_ps = ps; });
+
+    wgpuShaderModuleRelease(shader_module);
+
+    WGPUSamplerDescriptor sampler_desc = {
+        .addressModeU = WGPUAddressMode_ClampToEdge,
+        .addressModeV = WGPUAddressMode_ClampToEdge,
+        .magFilter = WGPUFilterMode_Linear,
+        .minFilter = WGPUFilterMode_Linear
+    };
+    d.blit_sampler = wgpuDeviceCreateSampler(d.device, &sampler_desc);
+
+    d.blit_ubuf = create_uniform_buffer(16);
+}
+
+// Moves the dynamic resolution scale in steps, down quickly when the frame time is over
+// the target and back up slowly while it is within it. With vsync the frame time cannot go
+// below the target, so going up is a probe that may be undone later.
+static void update_dynamic_resolution()
+{
+    auto &dr(d.dynamic_resolution);
+    const double now = emscripten_get_now();
+    const double frame_ms = dr.last_frame_time > 0.0 ? now - dr.last_frame_time : dr.target_ms;
+    dr.last_frame_time = now;
+    dr.avg_frame_ms = dr.avg_frame_ms > 0.0 ? dr.avg_frame_ms * 0.9 + frame_ms * 0.1 : frame_ms;
+    ++dr.frames_since_change;
+    if (!dr.enabled)
+        return;
+
+    const float prev_scale = dr.scale;
+    if (dr.avg_frame_ms > dr.target_ms * 1.2 && dr.frames_since_change >= 30)
+        dr.scale = std::max(0.5f, dr.scale - 0.1f);
+    else if (dr.avg_frame_ms < dr.target_ms * 1.05 && dr.frames_since_change >= 120)
+        dr.scale = std::min(1.0f, dr.scale + 0.05f);
+    if (dr.scale != prev_scale) {
+        dr.frames_since_change = 0;
+        printf("Dynamic resolution scale %.2f (%.2f ms per frame)\n", dr.scale, dr.avg_frame_ms);
+    }
+}
+
+static void begin_frame()
+{
+    process_deferred_releases();
+    enforce_gpu_memory_budget();
+    d.backbuffer.reset();
+    d.backbuffer = wgpuSwapChainGetCurrentTextureView(d.swapchain);
+    ensure_attachments();
+    d.res_encoder = wgpuDeviceCreateCommandEncoder(d.device, nullptr);
+    d.render_encoder = wgpuDeviceCreateCommandEncoder(d.device, nullptr);
+}
+
+static void end_frame()
+{
+    for (WGPUBuffer buf : d.active_ubuf_staging_buffers)
+        wgpuBufferUnmap(buf);
+
+    if (d.color_target_view)
+        blit_color_target();
+
+    WGPUCommandBuffer res_cb = wgpuCommandEncoderFinish(d.res_encoder, nullptr);
+    releaseAndNull(d.res_encoder);
+
+    WGPUCommandBuffer render_cb = wgpuCommandEncoderFinish(d.render_encoder, nullptr);
+    releaseAndNull(d.render_encoder);
+
+    WGPUCommandBuffer cbs[] = { res_cb, render_cb };
+    wgpuQueueSubmit(d.queue, 2, cbs);
+    record_input_latency(d.frame_count, emscripten_get_now());
 
     wgpuCommandBufferRelease(render_cb);
     wgpuCommandBufferRelease(res_cb);
 
+    wgpuQueueOnSubmittedWorkDone(d.queue, [](WGPUQueueWorkDoneStatus status, void *userdata) {
+        const uint32_t frame = uint32_t(uintptr_t(userdata));
+        // the time is taken here, the completion may run a frame later
+        const double t = emscripten_get_now();
+        post_completion([frame, t] {
+            d.completed_frame = std::max(d.completed_frame, frame);
+            input_frame_done(frame, t);
+        });
+    }, reinterpret_cast<void *>(uintptr_t(d.frame_count)));
+
     for (WGPUBuffer buf : d.active_ubuf_staging_buffers) {
-        wgpuBufferMapAsync(buf, WGPUMapMode_Write, 0, MAX_UBUF_SIZE, [](WGPUBufferMapAsyncStatus status, void *userdata) {
-            d.free_ubuf_staging_buffers.push_back(static_cast<WGPUBuffer>(userdata));
+        d.mapping_ubuf_staging_buffers.push_back(buf);
+        wgpuBufferMapAsync(buf, WGPUMapMode_Write, 0, wgpuBufferGetSize(buf), [](WGPUBufferMapAsyncStatus status, void *userdata) {
+            WGPUBuffer buf = static_cast<WGPUBuffer>(userdata);
+            post_completion([buf] {
+                // not there anymore when released by cleanup() in the meantime
+                auto it = std::find(d.mapping_ubuf_staging_buffers.begin(), d.mapping_ubuf_staging_buffers.end(), buf);
+                if (it == d.mapping_ubuf_staging_buffers.end())
+                    return;
+                d.mapping_ubuf_staging_buffers.erase(it);
+                d.free_ubuf_staging_buffers.push_back(buf);
+            });
         }, buf);
     }
     d.active_ubuf_staging_buffers.clear();
+
+    reset_frame_arena();
+    sample_heap_stats();
 }
 
 static WGPURenderPassEncoder begin_render_pass(WGPUColor clear_color, float depth_clear_value = 1.0f, uint32_t stencil_clear_value = 0)
 {
     WGPURenderPassColorAttachment attachment = {
-        .view = d.backbuffer,
+        .view = d.color_target_view ? d.color_target_view : d.backbuffer.get(),
         .loadOp = WGPULoadOp_Clear,
         .storeOp = WGPUStoreOp_Store,
         .clearValue = clear_color
     };
 
+    // stencil ops must be left undefined for depth-only formats
     WGPURenderPassDepthStencilAttachment depthStencilAttachment = {
         .view = d.ds_view,
         .depthLoadOp = WGPULoadOp_Clear,
         .depthStoreOp = WGPUStoreOp_Discard,
         .depthClearValue = depth_clear_value,
-        .stencilLoadOp = WGPULoadOp_Clear,
-        .stencilStoreOp = WGPUStoreOp_Discard,
+        .stencilLoadOp = DEPTH_ATTACHMENT_STENCIL ? WGPULoadOp_Clear : WGPULoadOp_Undefined,
+        .stencilStoreOp = DEPTH_ATTACHMENT_STENCIL ? WGPUStoreOp_Discard : WGPUStoreOp_Undefined,
         .stencilClearValue = stencil_clear_value
     };
 
@@ -1126,7 +3621,13 @@ static WGPURenderPassEncoder begin_render_pass(WGPUColor clear_color, float dept
         .depthStencilAttachment = &depthStencilAttachment
     };
 
-    return wgpuCommandEncoderBeginRenderPass(d.render_encoder, &renderpass);
+    WGPURenderPassEncoder pass = wgpuCommandEncoderBeginRenderPass(d.render_encoder, &renderpass);
+    if (d.color_target_view) {
+        // the attachments may be rounded up, only render_size of them is visible
+        wgpuRenderPassEncoderSetViewport(pass, 0, 0, d.render_size.width, d.render_size.height, 0, 1);
+        wgpuRenderPassEncoderSetScissorRect(pass, 0, 0, d.render_size.width, d.render_size.height);
+    }
+    return pass;
 }
 
 static void end_render_pass(WGPURenderPassEncoder pass)
@@ -1135,6 +3636,50 @@ static void end_render_pass(WGPURenderPassEncoder pass)
     wgpuRenderPassEncoderRelease(pass);
 }
 
+// for recording draws compatible with begin_render_pass()
+static WGPURenderBundleEncoder begin_render_bundle()
+{
+    WGPUTextureFormat color_format = WGPUTextureFormat_BGRA8Unorm;
+    WGPURenderBundleEncoderDescriptor desc = {
+        .colorFormatCount = 1,
+        .colorFormats = &color_format,
+        .depthStencilFormat = DEPTH_FORMAT,
+        .sampleCount = 1
+    };
+    return wgpuDeviceCreateRenderBundleEncoder(d.device, &desc);
+}
+
+static WGPURenderBundle end_render_bundle(WGPURenderBundleEncoder encoder)
+{
+    WGPURenderBundle bundle = wgpuRenderBundleEncoderFinish(encoder, nullptr);
+    wgpuRenderBundleEncoderRelease(encoder);
+    return bundle;
+}
+
+// A draw sequence that is the same every frame, recorded once into a render bundle and
+// replayed from then on. Recorded again only when one of the objects it uses (pipelines,
+// bind groups, buffers, passed in as deps) is different from the last recording.
+struct StaticDraws
+{
+    std::vector<const void *> deps;
+    GpuHandle<WGPURenderBundle> bundle;
+};
+
+using RecordStaticDrawsCallback = Delegate<void(WGPURenderBundleEncoder)>;
+
+static void execute_static_draws(WGPURenderPassEncoder pass, StaticDraws *draws, std::initializer_list<const void *> deps,
+                                 const RecordStaticDrawsCallback &record)
+{
+    if (!draws->bundle || !std::equal(deps.begin(), deps.end(), draws->deps.begin(), draws->deps.end())) {
+        draws->bundle.reset();
+        WGPURenderBundleEncoder encoder = begin_render_bundle();
+        record(encoder);
+        draws->bundle = end_render_bundle(encoder);
+        draws->deps.assign(deps.begin(), deps.end());
+    }
+    wgpuRenderPassEncoderExecuteBundles(pass, 1, draws->bundle.ptr());
+}
+
 static void init()
 {
     wgpuDeviceSetUncapturedErrorCallback(d.device, [](WGPUErrorType errorType, const char* message, void*) {
@@ -1167,29 +3712,67 @@ static void init()
     printf("Created swapchain %dx%d (%p)\n", d.fb_size.width, d.fb_size.height, d.swapchain);
 
     init_gui_renderer();
+    init_blit();
+
+    // attachments not used by the last frame are only kept around for resizing
+    add_gpu_memory_evictor(&d, [] { return trim_attachment_pool(0); });
 
     d.scene.init();
+
+    startup_milestone("gpu init done");
 }
 
 static void cleanup()
 {
+    // nothing queued runs anymore, so neither do the continuations of run_job_async()
+    d.jobs.stop();
+    d.completions.clear();
+    for (AsyncJob *a : d.async_jobs)
+        delete a;
+    d.async_jobs.clear();
+
     d.scene.cleanup();
 
-    releaseAndNull(d.gui_font_texture);
-    releaseAndNull(d.gui_font_texture_view);
-    releaseAndNull(d.gui_sampler);
-    releaseAndNull(d.gui_vbuf);
-    releaseAndNull(d.gui_ibuf);
-    releaseAndNull(d.gui_ubuf);
-    releaseAndNull(d.gui_shader_module);
-    releaseAndNull(d.gui_bgl);
-    releaseAndNull(d.gui_pl);
-    releaseAndNull(d.gui_ps);
-    releaseAndNull(d.gui_bg);
-
-    releaseAndNull(d.ds_view);
-    releaseAndNull(d.ds);
-    releaseAndNull(d.backbuffer);
+    d.gui_font_texture.reset();
+    d.gui_font_texture_view.reset();
+    d.gui_sampler.reset();
+    d.gui_vbuf.reset();
+    d.gui_ibuf.reset();
+    d.gui_ubuf.reset();
+    d.gui_shader_module.reset();
+    d.gui_bgl.reset();
+    d.gui_pl.reset();
+    d.gui_ps.reset();
+    d.gui_image_ps.reset();
+    d.gui_blit_ps.reset();
+    d.gui_blit_image_ps.reset();
+    d.gui_bg_cache.clear();
+
+    d.render_pipeline_cache.clear();
+    d.render_pipeline_cache_layouts.clear();
+    d.shader_module_cache.clear();
+
+    release_attachments();
+    d.blit_bgl.reset();
+    d.blit_pl.reset();
+    d.blit_ps.reset();
+    d.blit_bg.reset();
+    d.blit_sampler.reset();
+    d.blit_ubuf.reset();
+    d.backbuffer.reset();
+    for (WGPUBuffer &buf : d.free_ubuf_staging_buffers)
+        releaseAndNull(buf);
+    d.free_ubuf_staging_buffers.clear();
+    for (WGPUBuffer &buf : d.mapping_ubuf_staging_buffers)
+        releaseAndNull(buf);
+    d.mapping_ubuf_staging_buffers.clear();
+
+    // nothing is going to be submitted anymore
+    process_deferred_releases(true);
+    release_gpu_heaps();
+    process_deferred_releases(true);
+    report_gpu_memory_leaks();
+    d.gpu_memory.evictors.clear();
     releaseAndNull(d.swapchain);
     releaseAndNull(d.surface);
     releaseAndNull(d.queue);
@@ -1197,15 +3780,25 @@ static void cleanup()
     releaseAndNull(d.instance);
 
     ImGui::DestroyContext();
+    release_font_sources();
 }
 
 static void frame()
 {
+    run_completions();
+
+    if (d.size_dirty) {
+        d.size_dirty = false;
+        update_size();
+    }
+
     if (d.swapchain) {
+        update_dynamic_resolution();
         begin_frame();
         next_gui_frame();
         d.scene.render();
         end_frame();
+        startup_milestone("first frame");
     }
 
     if (d.quit) {
@@ -1229,19 +3822,36 @@ static void init_wgpu(InitWGpuCallback callback)
             puts("WebGPU unavailable");
             exit(0);
         }
+        startup_milestone("adapter");
         wgpuAdapterRequestDevice(adapter, nullptr, [](WGPURequestDeviceStatus status, WGPUDevice dev, const char* message, void* userdata) {
             if (message)
                 printf("wgpuAdapterRequestDevice: %s\n", message);
+            startup_milestone("device");
             reinterpret_cast<InitWGpuCallback>(userdata)(instance, dev);
         }, userdata);
     }, reinterpret_cast<void *>(callback));
 }
 
+// A file handed over by JS, data was allocated with Module._malloc() and is freed after the
+// callback has seen it
+struct LoadedLocalFile
+{
+    std::string filename;
+    std::string mime_type;
+    char *data;
+    size_t size;
+};
+
 extern "C" {
 EMSCRIPTEN_KEEPALIVE int _file_loaded(const char *filename, const char *mime_type, char *data, size_t size)
 {
-    if (d.local_file_load_callback)
-        d.local_file_load_callback(filename, mime_type, data, size);
+    LoadedLocalFile *file = new LoadedLocalFile { filename, mime_type, data, size };
+    post_completion([file] {
+        if (d.local_file_load_callback)
+            d.local_file_load_callback(file->filename.c_str(), file->mime_type.c_str(), file->data, file->size);
+        free(file->data);
+        delete file;
+    });
     return 1;
 }
 }
@@ -1255,7 +3865,6 @@ EM_JS(void, initialize_local_file_uploader, (), {
             Module.HEAPU8.set(data, buf);
             Module.ccall('_file_loaded', 'number', ['string', 'string', 'number', 'number'],
                 [event.target.filename, event.target.mime_type, buf, data.length]);
-            Module._free(buf);
         };
         file_reader.filename = e.target.files[0].name;
         file_reader.mime_type = e.target.files[0].type;
@@ -1285,7 +3894,8 @@ EM_JS(void, initialize_local_file_downloader, (), {
 });
 
 EM_JS(void, begin_save_local_file, (const char *filename, const char *mime_type, const void *data, size_t size), {
-    var data = new Uint8Array(Module.HEAPU8.buffer, data, size);
+    // a copy, Blob does not take views of a shared (threaded build) heap
+    var data = Module.HEAPU8.slice(data, data + size);
     var blob = new Blob([data]);
     var a = globalThis["save_file_element"];
     a.download = UTF8ToString(filename);
@@ -1300,7 +3910,7 @@ static void save_local_file(const char *filename, const char *mime_type, const v
 
 // Modern alternative using the Filesystem API
 
-EM_JS(bool, has_fs_api, (), {
+EM_JS(bool, query_fs_api, (), {
     if (window.showOpenFilePicker === undefined)
         return false;
     if (window.showSaveFilePicker === undefined)
@@ -1308,11 +3918,22 @@ EM_JS(bool, has_fs_api, (), {
     return true;
 });
 
+static bool has_fs_api()
+{
+    return d.fs_api;
+}
+
 extern "C" {
 EMSCRIPTEN_KEEPALIVE int _file_loaded_fs_api(const char *filename, char *data, size_t size)
 {
-    if (d.local_file_load_fs_api_callback)
-        d.local_file_load_fs_api_callback(filename, data, size);
+    LoadedLocalFile *file = new LoadedLocalFile { filename, std::string(), data, size };
+    post_completion([file] {
+        d.fs_api_file_handle = true;
+        if (d.local_file_load_fs_api_callback)
+            d.local_file_load_fs_api_callback(file->filename.c_str(), file->data, file->size);
+        free(file->data);
+        delete file;
+    });
     return 1;
 }
 }
@@ -1320,6 +3941,7 @@ EMSCRIPTEN_KEEPALIVE int _file_loaded_fs_api(const char *filename, char *data, s
 EM_JS(void, begin_load_local_file_fs_api, (), {
     window.showOpenFilePicker().then((fileHandles) => {
         if (fileHandles.length > 0) {
+            globalThis["fs_api_file_handle"] = fileHandles[0];
             const data = fileHandles[0].getFile().then((file) => {
                 file.arrayBuffer().then((result) => {
                     const data = new Uint8Array(result);
@@ -1327,7 +3949,6 @@ EM_JS(void, begin_load_local_file_fs_api, (), {
                     Module.HEAPU8.set(data, buf);
                     Module.ccall('_file_loaded_fs_api', 'number', ['string', 'number', 'number'],
                         [file.name, buf, data.length]);
-                    Module._free(buf);
                 });
             }).catch(err => { console.log(err); });
         }
@@ -1340,29 +3961,107 @@ static void load_local_file_fs_api(LocalFileLoadFsApiCallback callback)
     begin_load_local_file_fs_api();
 }
 
+// The handle of the last file opened or saved via the picker allows writing again without
+// asking. Whether there is one is mirrored in d.fs_api_file_handle, so that the GUI does
+// not have to call into JS every frame.
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE int _fs_api_file_handle_saved()
+{
+    post_completion([] { d.fs_api_file_handle = true; });
+    return 1;
+}
+}
+
 EM_JS(void, begin_save_local_file_fs_api, (const char *filename, const void *data, size_t size), {
+    // copied right away, the data may change while the picker is open
+    const arr = Module.HEAPU8.slice(data, data + size);
     window.showSaveFilePicker({
         "suggestedName": UTF8ToString(filename)
-    }).then((fileHandle) => {
-        fileHandle.createWritable().then((writableHandle) => {
-            var arr = new Uint8Array(Module.HEAPU8.buffer, data, size);
-            writableHandle.write(arr).then(() => {
-                writableHandle.close();
-            }).catch(err => { console.log(err); });
-        }).catch(err => { console.log(err); });
-    }).catch(err => {});
+    }).then(async (fileHandle) => {
+        const writableHandle = await fileHandle.createWritable();
+        await writableHandle.write(arr);
+        await writableHandle.close();
+        globalThis["fs_api_file_handle"] = fileHandle;
+        Module.ccall('_fs_api_file_handle_saved', 'number', [], []);
+        Module.ccall('_file_saved_fs_api', 'number', ['number'], [1]);
+    }).catch(err => {
+        // also when the picker was cancelled
+        console.log(err);
+        Module.ccall('_file_saved_fs_api', 'number', ['number'], [0]);
+    });
 });
 
-static void save_local_file_fs_api(const char *filename, const void *data, size_t size)
+// The callback gets whether the file was written, false when the picker was cancelled
+static void save_local_file_fs_api(const char *filename, const void *data, size_t size, LocalFileSaveFsApiCallback callback)
 {
+    d.local_file_save_fs_api_callback = callback;
     begin_save_local_file_fs_api(filename, data, size);
 }
 
+static bool has_fs_api_file_handle()
+{
+    return d.fs_api_file_handle;
+}
+
+EM_JS(void, clear_fs_api_file_handle, (), {
+    globalThis["fs_api_file_handle"] = undefined;
+});
+
+static void forget_fs_api_file_handle()
+{
+    d.fs_api_file_handle = false;
+    clear_fs_api_file_handle();
+}
+
+extern "C" {
+EMSCRIPTEN_KEEPALIVE int _file_saved_fs_api(int ok)
+{
+    post_completion([ok] {
+        if (d.local_file_save_fs_api_callback)
+            d.local_file_save_fs_api_callback(ok != 0);
+    });
+    return 1;
+}
+}
+
+EM_JS(void, begin_save_local_file_ranges_fs_api, (const void *data, const uint32_t *ranges, int range_count, size_t size), {
+    const chunks = [];
+    for (let i = 0; i < range_count; ++i) {
+        const start = Module.HEAPU32[(ranges >> 2) + i * 2];
+        const end = Module.HEAPU32[(ranges >> 2) + i * 2 + 1];
+        chunks.push({ position: start, data: Module.HEAPU8.slice(data + start, data + end) });
+    }
+    globalThis["fs_api_file_handle"].createWritable({ keepExistingData: true }).then(async (writableHandle) => {
+        for (const chunk of chunks)
+            await writableHandle.write({ type: 'write', position: chunk.position, data: chunk.data });
+        await writableHandle.truncate(size);
+        await writableHandle.close();
+        Module.ccall('_file_saved_fs_api', 'number', ['number'], [1]);
+    }).catch(err => {
+        console.log(err);
+        Module.ccall('_file_saved_fs_api', 'number', ['number'], [0]);
+    });
+});
+
+// Rewrites only the given [start, end) pairs of the current file, then truncates it to size.
+// The modified bytes are copied before returning, data may change afterwards.
+static void save_local_file_ranges_fs_api(const void *data, const std::vector<uint32_t> &ranges, size_t size, LocalFileSaveFsApiCallback callback)
+{
+    d.local_file_save_fs_api_callback = callback;
+    begin_save_local_file_ranges_fs_api(data, ranges.data(), int(ranges.size() / 2), size);
+}
+
 int main()
 {
+    startup_milestone("main");
+
+    start_jobs();
+
     ImGui::CreateContext();
 
     update_size();
+    printf("size: win %dx%d fb %dx%d dpr %f\n", d.win_size.width, d.win_size.height, d.fb_size.width, d.fb_size.height, d.dpr);
 
     emscripten_set_resize_callback(EMSCRIPTEN_EVENT_TARGET_WINDOW, 0, false, size_changed);
 
@@ -1380,6 +4079,7 @@ int main()
 
     initialize_local_file_uploader();
     initialize_local_file_downloader();
+    d.fs_api = query_fs_api();
 
     init_wgpu([](WGPUInstance instance, WGPUDevice dev) {
         d.instance = instance;
@@ -1388,6 +4088,12 @@ int main()
         emscripten_set_main_loop(frame, 0, false);
     });
 
+    // The adapter and device callbacks cannot run before main() returns, do the CPU
+    // side work that does not need them in the meantime
+    if (bake_gui_font_atlas("RobotoMono-Medium.ttf"))
+        startup_milestone("font atlas baked");
+    d.scene.start_loading();
+
     return 0;
 }
 
@@ -1411,90 +4117,1352 @@ struct VertexOutput {
     return output;
 }
 
-@fragment fn f_main(@location(0) color : vec3<f32>) -> @location(0) vec4<f32> {
-    return vec4<f32>(color, 1.0);
+@fragment fn f_main(@location(0) color : vec3<f32>) -> @location(0) vec4<f32> {
+    return vec4<f32>(color, 1.0);
+}
+)end";
+
+// Many copies of the triangle in one draw. Per-instance data lives in a storage buffer
+// indexed by instance_index and the animation is done in the shader, so the only per-frame
+// CPU work is one uniform update, regardless of the instance count.
+static const char *instanced_color_material_shaders = R"end(
+struct Uniforms {
+    view_projection : mat4x4<f32>,
+    time : f32,
+}
+@binding(0) @group(0) var<uniform> u : Uniforms;
+
+struct Instance {
+    position_scale : vec4<f32>,
+    phase_speed : vec4<f32>,
+}
+@binding(1) @group(0) var<storage, read> instances : array<Instance>;
+@binding(2) @group(0) var<storage, read> mvps : array<mat4x4<f32>>;
+@binding(3) @group(0) var<storage, read> visible : array<u32>;
+
+struct VertexOutput {
+    @builtin(position) Position : vec4<f32>,
+    @location(0) color : vec3<f32>
+}
+
+@vertex fn v_main(@builtin(instance_index) instance_index : u32, @location(0) position : vec4<f32>, @location(1) color : vec3<f32>) -> VertexOutput {
+    let inst = instances[visible[instance_index]];
+    let angle = inst.phase_speed.x + u.time * inst.phase_speed.y;
+    let c = cos(angle);
+    let s = sin(angle);
+    let p = position.xyz * inst.position_scale.w;
+    let world = vec3<f32>(c * p.x + s * p.z, p.y, c * p.z - s * p.x) + inst.position_scale.xyz;
+    var output : VertexOutput;
+    output.Position = u.view_projection * vec4<f32>(world, 1.0);
+    output.color = color;
+    return output;
+}
+
+// the same with the matrices computed on the CPU (batch_mvp)
+@vertex fn v_main_mvp(@builtin(instance_index) instance_index : u32, @location(0) position : vec4<f32>, @location(1) color : vec3<f32>) -> VertexOutput {
+    var output : VertexOutput;
+    output.Position = mvps[instance_index] * position;
+    output.color = color;
+    return output;
+}
+
+@fragment fn f_main(@location(0) color : vec3<f32>) -> @location(0) vec4<f32> {
+    return vec4<f32>(color, 1.0);
+}
+)end";
+
+struct InstanceData
+{
+    float position_scale[4];
+    float phase_speed[4];
+};
+
+// Per-object transforms as structure of arrays: translation, rotation around Y in
+// radians, uniform scale
+struct TransformsSoA
+{
+    void resize(size_t n)
+    {
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        angle.resize(n);
+        scale.resize(n);
+    }
+    size_t size() const { return x.size(); }
+
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    std::vector<float> angle;
+    std::vector<float> scale;
+};
+
+static inline void store_mvp(float *out, f32x4 vp0, f32x4 vp1, f32x4 vp2, f32x4 vp3,
+                             float sin_a, float cos_a, float scale, float x, float y, float z)
+{
+    // view_projection * translate(x, y, z) * rotate_y(a) * scale(s), column by column
+    const f32x4 cs = f32x4_splat(cos_a * scale);
+    const f32x4 ss = f32x4_splat(sin_a * scale);
+    f32x4_store(out, f32x4_sub(f32x4_mul(vp0, cs), f32x4_mul(vp2, ss)));
+    f32x4_store(out + 4, f32x4_mul(vp1, f32x4_splat(scale)));
+    f32x4_store(out + 8, f32x4_add(f32x4_mul(vp0, ss), f32x4_mul(vp2, cs)));
+    f32x4_store(out + 12, f32x4_add(f32x4_add(f32x4_mul(vp0, f32x4_splat(x)), f32x4_mul(vp1, f32x4_splat(y))),
+                                    f32x4_add(f32x4_mul(vp2, f32x4_splat(z)), vp3)));
+}
+
+// Writes count column-major MVP matrices (16 floats each) for the transforms starting at
+// first to out, which can be mapped staging memory. Sine and cosine are computed four
+// objects at a time (Cephes style polynomials after reduction to +-pi/4), the matrix
+// columns are linear combinations of the view_projection columns.
+static void batch_mvp(const TransformsSoA &t, size_t first, size_t count, const glm::mat4 &view_projection, float *out)
+{
+    const f32x4 vp0 = f32x4_load(&view_projection[0][0]);
+    const f32x4 vp1 = f32x4_load(&view_projection[1][0]);
+    const f32x4 vp2 = f32x4_load(&view_projection[2][0]);
+    const f32x4 vp3 = f32x4_load(&view_projection[3][0]);
+    const float *angle = t.angle.data() + first;
+    for (size_t i = 0; i < count; i += 4) {
+        const size_t n = std::min<size_t>(4, count - i);
+        float a4[4] = {};
+        memcpy(a4, angle + i, n * sizeof(float));
+        const f32x4 a = f32x4_load(a4);
+        const f32x4 j = f32x4_round(f32x4_mul(a, f32x4_splat(0.636619772f)));
+        // a - j * pi / 2 in three steps to keep the precision
+        f32x4 r = f32x4_sub(a, f32x4_mul(j, f32x4_splat(1.5703125f)));
+        r = f32x4_sub(r, f32x4_mul(j, f32x4_splat(4.837512969970703125e-4f)));
+        r = f32x4_sub(r, f32x4_mul(j, f32x4_splat(7.54978995489188216e-8f)));
+        const f32x4 r2 = f32x4_mul(r, r);
+        f32x4 sp = f32x4_add(f32x4_mul(r2, f32x4_splat(-1.9515295891e-4f)), f32x4_splat(8.3321608736e-3f));
+        sp = f32x4_add(f32x4_mul(r2, sp), f32x4_splat(-1.6666654611e-1f));
+        const f32x4 sin_r = f32x4_add(r, f32x4_mul(f32x4_mul(r, r2), sp));
+        f32x4 cp = f32x4_add(f32x4_mul(r2, f32x4_splat(2.443315711809948e-5f)), f32x4_splat(-1.388731625493765e-3f));
+        cp = f32x4_add(f32x4_mul(r2, cp), f32x4_splat(4.166664568298827e-2f));
+        const f32x4 cos_r = f32x4_add(f32x4_sub(f32x4_splat(1.0f), f32x4_mul(r2, f32x4_splat(0.5f))), f32x4_mul(f32x4_mul(r2, r2), cp));
+        float s4[4], c4[4], j4[4];
+        f32x4_store(s4, sin_r);
+        f32x4_store(c4, cos_r);
+        f32x4_store(j4, j);
+        for (size_t k = 0; k < n; ++k) {
+            const size_t idx = first + i + k;
+            float sin_a, cos_a;
+            switch (int(j4[k]) & 3) {
+            case 0: sin_a = s4[k]; cos_a = c4[k]; break;
+            case 1: sin_a = c4[k]; cos_a = -s4[k]; break;
+            case 2: sin_a = -s4[k]; cos_a = -c4[k]; break;
+            default: sin_a = -c4[k]; cos_a = s4[k]; break;
+            }
+            store_mvp(out + (i + k) * 16, vp0, vp1, vp2, vp3, sin_a, cos_a, t.scale[idx], t.x[idx], t.y[idx], t.z[idx]);
+        }
+    }
+}
+
+// Pieces batch_mvp is split into for the job threads: below this, waking them costs more
+// than it saves
+static const size_t TRANSFORM_JOB_MIN_CHUNK = 4096;
+
+// Frustum planes of a view-projection matrix (depth 0..1), normalized and stored as
+// structure of arrays in two groups of four, so that a box or sphere is tested against
+// all six with two f32x4 evaluations. The two spare slots never reject anything.
+struct Frustum
+{
+    enum Result {
+        Outside,
+        Intersecting,
+        Inside
+    };
+
+    void set(const glm::mat4 &view_projection);
+    Result classify_box(const float center[3], const float extent[3]) const;
+    bool sphere_visible(float x, float y, float z, float radius) const;
+
+    alignas(16) float nx[8];
+    alignas(16) float ny[8];
+    alignas(16) float nz[8];
+    alignas(16) float dist[8];
+    alignas(16) float abs_nx[8];
+    alignas(16) float abs_ny[8];
+    alignas(16) float abs_nz[8];
+};
+
+void Frustum::set(const glm::mat4 &m)
+{
+    const glm::vec4 r0(m[0][0], m[1][0], m[2][0], m[3][0]);
+    const glm::vec4 r1(m[0][1], m[1][1], m[2][1], m[3][1]);
+    const glm::vec4 r2(m[0][2], m[1][2], m[2][2], m[3][2]);
+    const glm::vec4 r3(m[0][3], m[1][3], m[2][3], m[3][3]);
+    const glm::vec4 planes[8] = {
+        r3 + r0, // left
+        r3 - r0, // right
+        r3 + r1, // bottom
+        r3 - r1, // top
+        r2, // near
+        r3 - r2, // far
+        glm::vec4(0.0f, 0.0f, 0.0f, 1e30f),
+        glm::vec4(0.0f, 0.0f, 0.0f, 1e30f)
+    };
+    for (int i = 0; i < 8; ++i) {
+        const float len = glm::length(glm::vec3(planes[i]));
+        const glm::vec4 p = i < 6 && len > 0.0f ? planes[i] / len : planes[i];
+        nx[i] = p.x;
+        ny[i] = p.y;
+        nz[i] = p.z;
+        dist[i] = p.w;
+        abs_nx[i] = fabsf(p.x);
+        abs_ny[i] = fabsf(p.y);
+        abs_nz[i] = fabsf(p.z);
+    }
+}
+
+Frustum::Result Frustum::classify_box(const float center[3], const float extent[3]) const
+{
+    const f32x4 cx = f32x4_splat(center[0]), cy = f32x4_splat(center[1]), cz = f32x4_splat(center[2]);
+    const f32x4 ex = f32x4_splat(extent[0]), ey = f32x4_splat(extent[1]), ez = f32x4_splat(extent[2]);
+    const f32x4 zero = f32x4_splat(0.0f);
+    uint32_t intersecting = 0;
+    for (int g = 0; g < 8; g += 4) {
+        const f32x4 d = f32x4_add(f32x4_add(f32x4_mul(f32x4_load(nx + g), cx), f32x4_mul(f32x4_load(ny + g), cy)),
+                                  f32x4_add(f32x4_mul(f32x4_load(nz + g), cz), f32x4_load(dist + g)));
+        const f32x4 r = f32x4_add(f32x4_add(f32x4_mul(f32x4_load(abs_nx + g), ex), f32x4_mul(f32x4_load(abs_ny + g), ey)),
+                                  f32x4_mul(f32x4_load(abs_nz + g), ez));
+        if (f32x4_lt_mask(f32x4_add(d, r), zero))
+            return Outside;
+        intersecting |= f32x4_lt_mask(f32x4_sub(d, r), zero);
+    }
+    return intersecting ? Intersecting : Inside;
+}
+
+bool Frustum::sphere_visible(float x, float y, float z, float radius) const
+{
+    const f32x4 cx = f32x4_splat(x), cy = f32x4_splat(y), cz = f32x4_splat(z);
+    const f32x4 neg_r = f32x4_splat(-radius);
+    for (int g = 0; g < 8; g += 4) {
+        const f32x4 d = f32x4_add(f32x4_add(f32x4_mul(f32x4_load(nx + g), cx), f32x4_mul(f32x4_load(ny + g), cy)),
+                                  f32x4_add(f32x4_mul(f32x4_load(nz + g), cz), f32x4_load(dist + g)));
+        if (f32x4_lt_mask(d, neg_r))
+            return false;
+    }
+    return true;
+}
+
+struct CullStats
+{
+    uint32_t cells_tested = 0;
+    uint32_t cells_culled = 0;
+    uint32_t objects_tested = 0;
+    uint32_t objects_visible = 0;
+    uint32_t objects_culled = 0;
+    uint32_t objects_moved = 0;
+    double ms = 0.0;
+};
+
+// Loose uniform grid over object centers. Each cell is culled as its box grown by the
+// largest object radius, so an object only changes cells when its center does, and
+// moving objects is a cheap swap-remove and append.
+struct LooseGrid
+{
+    void init(const TransformsSoA &t, size_t count, float cell_size, float margin, float max_radius);
+    void move(uint32_t id, float x, float y, float z);
+    void cull(const Frustum &frustum, const TransformsSoA &t, float radius_per_scale, uint32_t count,
+              std::vector<uint32_t> *visible, CullStats *stats) const;
+    uint32_t cell_for(float x, float y, float z) const;
+
+    float origin[3];
+    float cell_size;
+    float max_radius;
+    float overflow; // how far objects went beyond the grid (and got clamped into border cells)
+    int dims[3];
+    std::vector<std::vector<uint32_t>> cells;
+    std::vector<uint32_t> cell_of;
+    std::vector<uint32_t> slot_of;
+};
+
+void LooseGrid::init(const TransformsSoA &t, size_t count, float cell_size_, float margin, float max_radius_)
+{
+    float lo[3] = { 1e30f, 1e30f, 1e30f };
+    float hi[3] = { -1e30f, -1e30f, -1e30f };
+    const float *pos[3] = { t.x.data(), t.y.data(), t.z.data() };
+    for (size_t i = 0; i < count; ++i) {
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = std::min(lo[a], pos[a][i]);
+            hi[a] = std::max(hi[a], pos[a][i]);
+        }
+    }
+    cell_size = cell_size_;
+    max_radius = max_radius_;
+    for (int a = 0; a < 3; ++a) {
+        origin[a] = lo[a] - margin;
+        dims[a] = std::max(1, int(ceilf((hi[a] - lo[a] + 2 * margin) / cell_size)));
+    }
+    overflow = 0.0f;
+    cells.assign(size_t(dims[0]) * dims[1] * dims[2], {});
+    cell_of.resize(count);
+    slot_of.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t c = cell_for(t.x[i], t.y[i], t.z[i]);
+        cell_of[i] = c;
+        slot_of[i] = cells[c].size();
+        cells[c].push_back(i);
+    }
+}
+
+uint32_t LooseGrid::cell_for(float x, float y, float z) const
+{
+    const float p[3] = { x, y, z };
+    int c[3];
+    for (int a = 0; a < 3; ++a)
+        c[a] = std::clamp(int(floorf((p[a] - origin[a]) / cell_size)), 0, dims[a] - 1);
+    return uint32_t((c[2] * dims[1] + c[1]) * dims[0] + c[0]);
+}
+
+void LooseGrid::move(uint32_t id, float x, float y, float z)
+{
+    const float p[3] = { x, y, z };
+    for (int a = 0; a < 3; ++a)
+        overflow = std::max(overflow, std::max(origin[a] - p[a], p[a] - (origin[a] + dims[a] * cell_size)));
+    const uint32_t c = cell_for(x, y, z);
+    const uint32_t old_c = cell_of[id];
+    if (c == old_c)
+        return;
+    std::vector<uint32_t> &old_cell(cells[old_c]);
+    const uint32_t last = old_cell.back();
+    old_cell[slot_of[id]] = last;
+    slot_of[last] = slot_of[id];
+    old_cell.pop_back();
+    cell_of[id] = c;
+    slot_of[id] = cells[c].size();
+    cells[c].push_back(id);
+}
+
+void LooseGrid::cull(const Frustum &frustum, const TransformsSoA &t, float radius_per_scale, uint32_t count,
+                     std::vector<uint32_t> *visible, CullStats *stats) const
+{
+    visible->clear();
+    const float e = cell_size * 0.5f + max_radius + overflow;
+    const float extent[3] = { e, e, e };
+    uint32_t c = 0;
+    for (int z = 0; z < dims[2]; ++z) {
+        for (int y = 0; y < dims[1]; ++y) {
+            for (int x = 0; x < dims[0]; ++x, ++c) {
+                const std::vector<uint32_t> &cell(cells[c]);
+                if (cell.empty())
+                    continue;
+                ++stats->cells_tested;
+                float center[3] = {
+                    origin[0] + (x + 0.5f) * cell_size,
+                    origin[1] + (y + 0.5f) * cell_size,
+                    origin[2] + (z + 0.5f) * cell_size
+                };
+                const Frustum::Result r = frustum.classify_box(center, extent);
+                if (r == Frustum::Outside) {
+                    ++stats->cells_culled;
+                    continue;
+                }
+                for (uint32_t id : cell) {
+                    if (id >= count)
+                        continue;
+                    if (r == Frustum::Inside) {
+                        visible->push_back(id);
+                        continue;
+                    }
+                    ++stats->objects_tested;
+                    if (frustum.sphere_visible(t.x[id], t.y[id], t.z[id], t.scale[id] * radius_per_scale))
+                        visible->push_back(id);
+                }
+            }
+        }
+    }
+    stats->objects_visible = visible->size();
+    stats->objects_culled = count - visible->size();
+}
+
+// the straightforward glm version of batch_mvp, for comparison
+static void batch_mvp_glm(const TransformsSoA &t, size_t first, size_t count, const glm::mat4 &view_projection, float *out)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const size_t idx = first + i;
+        glm::mat4 model = glm::translate(glm::identity<glm::mat4>(), glm::vec3(t.x[idx], t.y[idx], t.z[idx]));
+        model = glm::rotate(model, t.angle[idx], glm::vec3(0.0f, 1.0f, 0.0f));
+        model = glm::scale(model, glm::vec3(t.scale[idx]));
+        const glm::mat4 mvp = view_projection * model;
+        memcpy(out + i * 16, &mvp[0], 64);
+    }
+}
+
+static float triangle_vertex_data[] = {
+     0.0f,   0.5f,  0.0f,    1.0f, 0.0f, 0.0f,
+    -0.5f,  -0.5f,  0.0f,    0.0f, 1.0f, 0.0f,
+     0.5f,  -0.5f,  0.0f,    0.0f, 0.0f, 1.0f
+};
+
+enum class LineEndings
+{
+    None,
+    LF,
+    CRLF,
+    CR,
+    Mixed
+};
+
+static const char *line_endings_name(LineEndings e)
+{
+    switch (e) {
+    case LineEndings::LF:
+        return "LF";
+    case LineEndings::CRLF:
+        return "CRLF";
+    case LineEndings::CR:
+        return "CR";
+    case LineEndings::Mixed:
+        return "Mixed";
+    default:
+        break;
+    }
+    return "-";
+}
+
+// Incremental UTF-8 validator (RFC 3629: no overlongs, surrogates or code points above U+10FFFF)
+struct Utf8State
+{
+    uint8_t need = 0;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+};
+
+static inline bool utf8_step(Utf8State &s, uint8_t c)
+{
+    if (s.need) {
+        if (c < s.lo || c > s.hi)
+            return false;
+        s.lo = 0x80;
+        s.hi = 0xBF;
+        --s.need;
+        return true;
+    }
+    if (c < 0x80)
+        return true;
+    if (c < 0xC2)
+        return false;
+    if (c < 0xE0) {
+        s.need = 1;
+        return true;
+    }
+    if (c < 0xF0) {
+        s.need = 2;
+        if (c == 0xE0)
+            s.lo = 0xA0;
+        else if (c == 0xED)
+            s.hi = 0x9F;
+        return true;
+    }
+    if (c < 0xF5) {
+        s.need = 3;
+        if (c == 0xF0)
+            s.lo = 0x90;
+        else if (c == 0xF4)
+            s.hi = 0x8F;
+        return true;
+    }
+    return false;
+}
+
+// Offsets of the line starts ('\n' terminated, like InputTextMultiline sees them),
+// plus line ending statistics and UTF-8 validity, all gathered in a single pass.
+// The statistics are also kept per line, so that an edit only rescans the lines it touched.
+struct LineIndex
+{
+    // line_info: the '\r' count of the line plus these flags
+    static const uint32_t LINE_CRLF = 1u << 30;
+    static const uint32_t LINE_BAD_UTF8 = 1u << 31;
+    static const uint32_t LINE_CR_MASK = LINE_CRLF - 1;
+
+    void build(const char *text, size_t size);
+    // text[edit_start, edit_end) is what changed, everything after it only moved
+    void update(const char *text, size_t size, uint32_t edit_start, uint32_t edit_end);
+    uint32_t line_count() const { return uint32_t(line_starts.size()); }
+    uint32_t line_for_offset(uint32_t offset) const;
+    LineEndings line_endings() const;
+    bool utf8_valid() const { return !bad_utf8_lines; }
+    void count_lines(const uint32_t *info, size_t n, bool remove);
+
+    std::vector<uint32_t> line_starts;
+    std::vector<uint32_t> line_info;
+    uint32_t text_size = 0;
+    uint32_t crlf_count = 0;
+    uint32_t cr_count = 0;
+    uint32_t bad_utf8_lines = 0;
+};
+
+// Appends the start and info of every line from the line start `from` on, until (and including)
+// the first line that ends at or after `stop`. Returns the start of the line after that one,
+// or SIZE_MAX when the end of the text was reached.
+static size_t scan_lines(const char *text, size_t size, size_t from, size_t stop,
+                         std::vector<uint32_t> *starts, std::vector<uint32_t> *infos)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(text);
+    Utf8State utf8;
+    uint32_t info = 0;
+    uint32_t prev_cr = 0;
+    size_t i = from;
+    starts->push_back(uint32_t(from));
+
+    const u8x16 lf = u8x16_splat('\n');
+    const u8x16 cr = u8x16_splat('\r');
+    for (; i + 16 <= size; i += 16) {
+        const u8x16 v = u8x16_load(p + i);
+        uint32_t lf_mask = u8x16_eq_mask(v, lf);
+        const uint32_t cr_mask = u8x16_eq_mask(v, cr);
+        // pure ASCII blocks outside of a multi-byte sequence need no further validation.
+        // A sequence cut short by '\n' fails on the '\n', so every line starts in sync.
+        uint32_t bad_mask = 0;
+        if (utf8.need || u8x16_high_mask(v)) {
+            for (int j = 0; j < 16; ++j) {
+                if (!utf8_step(utf8, p[i + j])) {
+                    bad_mask |= 1u << j;
+                    utf8 = Utf8State();
+                }
+            }
+        }
+        if (!(lf_mask | cr_mask | prev_cr | bad_mask))
+            continue;
+        uint32_t done = 0;
+        while (lf_mask) {
+            const uint32_t bit = __builtin_ctz(lf_mask);
+            const uint32_t line_mask = ((2u << bit) - 1) & ~done;
+            info += __builtin_popcount(cr_mask & line_mask);
+            if (((cr_mask << 1) | prev_cr) & (1u << bit))
+                info |= LineIndex::LINE_CRLF;
+            if (bad_mask & line_mask)
+                info |= LineIndex::LINE_BAD_UTF8;
+            infos->push_back(info);
+            info = 0;
+            if (i + bit >= stop)
+                return i + bit + 1;
+            starts->push_back(uint32_t(i + bit + 1));
+            done |= line_mask;
+            lf_mask &= lf_mask - 1;
+        }
+        info += __builtin_popcount(cr_mask & ~done);
+        if (bad_mask & ~done)
+            info |= LineIndex::LINE_BAD_UTF8;
+        prev_cr = cr_mask >> 15;
+    }
+
+    for (; i < size; ++i) {
+        const uint8_t c = p[i];
+        if (!utf8_step(utf8, c)) {
+            info |= LineIndex::LINE_BAD_UTF8;
+            utf8 = Utf8State();
+        }
+        if (c == '\n') {
+            if (prev_cr)
+                info |= LineIndex::LINE_CRLF;
+            infos->push_back(info);
+            info = 0;
+            if (i >= stop)
+                return i + 1;
+            starts->push_back(uint32_t(i + 1));
+        } else if (c == '\r') {
+            ++info;
+        }
+        prev_cr = c == '\r';
+    }
+
+    if (utf8.need)
+        info |= LineIndex::LINE_BAD_UTF8;
+    infos->push_back(info);
+    return SIZE_MAX;
+}
+
+void LineIndex::count_lines(const uint32_t *info, size_t n, bool remove)
+{
+    uint32_t crlf = 0;
+    uint32_t cr = 0;
+    uint32_t bad_utf8 = 0;
+    for (size_t i = 0; i < n; ++i) {
+        crlf += (info[i] & LINE_CRLF) != 0;
+        cr += info[i] & LINE_CR_MASK;
+        bad_utf8 += (info[i] & LINE_BAD_UTF8) != 0;
+    }
+    if (remove) {
+        crlf_count -= crlf;
+        cr_count -= cr;
+        bad_utf8_lines -= bad_utf8;
+    } else {
+        crlf_count += crlf;
+        cr_count += cr;
+        bad_utf8_lines += bad_utf8;
+    }
+}
+
+void LineIndex::build(const char *text, size_t size)
+{
+    line_starts.clear();
+    line_info.clear();
+    crlf_count = 0;
+    cr_count = 0;
+    bad_utf8_lines = 0;
+    scan_lines(text, size, 0, size, &line_starts, &line_info);
+    count_lines(line_info.data(), line_info.size(), false);
+    text_size = uint32_t(size);
+}
+
+// The lines before the edit are kept, the edited ones rescanned and the ones after it
+// only get their start shifted by the size difference
+void LineIndex::update(const char *text, size_t size, uint32_t edit_start, uint32_t edit_end)
+{
+    const uint32_t delta = uint32_t(size) - text_size; // wraps around when the text shrank
+    const uint32_t first = line_for_offset(edit_start);
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> infos;
+    const size_t next = scan_lines(text, size, line_starts[first], edit_end, &starts, &infos);
+    // the line after the rescanned ones starts after a '\n' that was not edited, so it is in the index
+    uint32_t last = line_count();
+    if (next != SIZE_MAX)
+        last = uint32_t(std::lower_bound(line_starts.begin() + first, line_starts.end(), uint32_t(next) - delta) - line_starts.begin());
+
+    count_lines(line_info.data() + first, last - first, true);
+    count_lines(infos.data(), infos.size(), false);
+    line_starts.erase(line_starts.begin() + first, line_starts.begin() + last);
+    line_starts.insert(line_starts.begin() + first, starts.begin(), starts.end());
+    line_info.erase(line_info.begin() + first, line_info.begin() + last);
+    line_info.insert(line_info.begin() + first, infos.begin(), infos.end());
+    for (size_t i = first + starts.size(); i < line_starts.size(); ++i)
+        line_starts[i] += delta;
+    text_size = uint32_t(size);
+}
+
+uint32_t LineIndex::line_for_offset(uint32_t offset) const
+{
+    auto it = std::upper_bound(line_starts.begin(), line_starts.end(), offset);
+    return uint32_t(it - line_starts.begin()) - 1;
+}
+
+LineEndings LineIndex::line_endings() const
+{
+    const uint32_t lf_only = line_count() - 1 - crlf_count;
+    const uint32_t cr_only = cr_count - crlf_count;
+    const int kinds = (lf_only ? 1 : 0) + (crlf_count ? 1 : 0) + (cr_only ? 1 : 0);
+    if (kinds == 0)
+        return LineEndings::None;
+    if (kinds > 1)
+        return LineEndings::Mixed;
+    if (lf_only)
+        return LineEndings::LF;
+    if (crlf_count)
+        return LineEndings::CRLF;
+    return LineEndings::CR;
+}
+
+// Appends the start offset of every (possibly overlapping) occurrence of needle that
+// starts in [from, to). Candidates are found 16 at a time by comparing the first and
+// the last byte of the needle, only those get a full memcmp.
+static void find_occurrences(const char *text, size_t size, const char *needle, size_t needle_size,
+                             size_t from, size_t to, std::vector<uint32_t> *out)
+{
+    if (!needle_size || needle_size > size)
+        return;
+    to = std::min(to, size - needle_size + 1);
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(text);
+    const u8x16 first = u8x16_splat(uint8_t(needle[0]));
+    const u8x16 last = u8x16_splat(uint8_t(needle[needle_size - 1]));
+    size_t i = from;
+    for (; i + 16 <= to; i += 16) {
+        uint32_t mask = u8x16_eq_mask(u8x16_load(p + i), first) & u8x16_eq_mask(u8x16_load(p + i + needle_size - 1), last);
+        while (mask) {
+            const size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(p + pos, needle, needle_size) == 0)
+                out->push_back(uint32_t(pos));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < to; ++i) {
+        if (p[i] == uint8_t(needle[0]) && memcmp(p + i, needle, needle_size) == 0)
+            out->push_back(uint32_t(i));
+    }
+}
+
+// Search state for the open document. The scan is sliced so that it never takes
+// more than a couple of milliseconds per frame, also for very large files.
+struct TextSearch
+{
+    static const size_t CHUNK_SIZE = 256 * 1024;
+    static const int MARKER_BUCKETS = 512;
+
+    void set_query(const char *text, size_t size, const char *new_query);
+    void restart();
+    void text_edited(const char *text, size_t size, size_t old_size, uint32_t edit_start, uint32_t edit_end);
+    void step(const char *text, size_t size, double budget_ms);
+    bool scanning() const { return scan_pos < scan_end; }
+    void update_markers(const LineIndex &index);
+
+    char query_input[256] = {};
+    char replacement_input[256] = {};
+    std::string query;
+    std::vector<uint32_t> matches; // sorted, may overlap
+    size_t scan_pos = 0;
+    size_t scan_end = 0;
+    double last_step_ms = 0.0;
+
+    // which parts of the document (in line terms) have matches, for the scrollbar
+    uint8_t markers[MARKER_BUCKETS] = {};
+    size_t markers_done = 0;
+};
+
+void TextSearch::set_query(const char *text, size_t size, const char *new_query)
+{
+    const std::string previous = query;
+    query = new_query;
+
+    // every occurrence of the longer query is an occurrence of its prefix as well,
+    // so typing more characters only needs to filter the existing results
+    if (!previous.empty() && !scanning() && query.size() > previous.size() && query.compare(0, previous.size(), previous) == 0) {
+        const size_t n = query.size();
+        matches.erase(std::remove_if(matches.begin(), matches.end(), [text, size, n, this](uint32_t pos) {
+            return pos + n > size || memcmp(text + pos, query.data(), n) != 0;
+        }), matches.end());
+        memset(markers, 0, sizeof(markers));
+        markers_done = 0;
+        return;
+    }
+
+    restart();
+    scan_end = query.empty() ? 0 : size;
+}
+
+void TextSearch::restart()
+{
+    matches.clear();
+    memset(markers, 0, sizeof(markers));
+    markers_done = 0;
+    scan_pos = 0;
+    scan_end = 0;
+}
+
+// text[edit_start, edit_end) replaced what was text[edit_start, edit_end - size + old_size).
+// Only matches overlapping it are searched again, the ones after it move along.
+void TextSearch::text_edited(const char *text, size_t size, size_t old_size, uint32_t edit_start, uint32_t edit_end)
+{
+    if (query.empty())
+        return;
+    const uint32_t delta = uint32_t(size - old_size); // wraps around when the text shrank
+    const uint32_t old_edit_end = edit_end - delta;
+    const uint32_t window_start = edit_start - std::min<uint32_t>(edit_start, query.size() - 1);
+
+    // the part not scanned yet is left to step()
+    if (scan_pos >= old_edit_end)
+        scan_pos = uint32_t(scan_pos + delta);
+    else if (scan_pos > window_start)
+        scan_pos = edit_end;
+    scan_end = size;
+
+    auto first = std::lower_bound(matches.begin(), matches.end(), window_start);
+    auto last = std::lower_bound(first, matches.end(), old_edit_end);
+    for (auto it = last; it != matches.end(); ++it)
+        *it += delta;
+    std::vector<uint32_t> found;
+    if (scan_pos > window_start)
+        find_occurrences(text, size, query.data(), query.size(), window_start, edit_end, &found);
+    const size_t at = first - matches.begin();
+    matches.erase(first, last);
+    matches.insert(matches.begin() + at, found.begin(), found.end());
+
+    memset(markers, 0, sizeof(markers));
+    markers_done = 0;
+}
+
+void TextSearch::step(const char *text, size_t size, double budget_ms)
+{
+    if (!scanning())
+        return;
+    const double t0 = emscripten_get_now();
+    scan_end = std::min(scan_end, size);
+    while (scan_pos < scan_end) {
+        const size_t to = std::min(scan_pos + CHUNK_SIZE, scan_end);
+        find_occurrences(text, size, query.data(), query.size(), scan_pos, to, &matches);
+        scan_pos = to;
+        if (emscripten_get_now() - t0 > budget_ms)
+            break;
+    }
+    last_step_ms = emscripten_get_now() - t0;
+}
+
+void TextSearch::update_markers(const LineIndex &index)
+{
+    const uint32_t line_count = index.line_count();
+    for (; markers_done < matches.size(); ++markers_done) {
+        const uint32_t line = index.line_for_offset(matches[markers_done]);
+        markers[uint64_t(line) * MARKER_BUCKETS / line_count] = 1;
+    }
+}
+
+// The open file: a NUL terminated buffer for InputTextMultiline, the actual length
+// (so there is no need for strlen and embedded NULs survive saving as long as the
+// text is not edited), and the byte ranges modified since the last save.
+struct Document
+{
+    struct Range
+    {
+        uint32_t start;
+        uint32_t end;
+    };
+
+    void assign(const char *text, size_t text_size);
+    void reserve(size_t new_capacity);
+    void mark_dirty(uint32_t start, uint32_t end);
+    void mark_all_dirty() { dirty.clear(); mark_dirty(0, std::max<uint32_t>(size, 1)); }
+    std::vector<uint32_t> take_dirty_ranges();
+
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+    size_t capacity = 0; // including the terminator, like ImGui's BufSize
+    std::vector<Range> dirty; // sorted, non-overlapping
+};
+
+void Document::assign(const char *text, size_t text_size)
+{
+    capacity = text_size + 1;
+    data.reset(new char[capacity]);
+    memcpy(data.get(), text, text_size);
+    data[text_size] = '\0';
+    size = text_size;
+    dirty.clear();
+}
+
+void Document::reserve(size_t new_capacity)
+{
+    if (new_capacity <= capacity)
+        return;
+    std::unique_ptr<char[]> new_data(new char[new_capacity]);
+    memcpy(new_data.get(), data.get(), std::min(size + 1, capacity));
+    data = std::move(new_data);
+    capacity = new_capacity;
+}
+
+void Document::mark_dirty(uint32_t start, uint32_t end)
+{
+    if (start >= end)
+        return;
+    auto it = std::lower_bound(dirty.begin(), dirty.end(), start, [](const Range &r, uint32_t v) { return r.end < v; });
+    auto last = it;
+    while (last != dirty.end() && last->start <= end) {
+        start = std::min(start, last->start);
+        end = std::max(end, last->end);
+        ++last;
+    }
+    it = dirty.erase(it, last);
+    dirty.insert(it, { start, end });
+}
+
+std::vector<uint32_t> Document::take_dirty_ranges()
+{
+    std::vector<uint32_t> ranges;
+    ranges.reserve(dirty.size() * 2);
+    for (const Range &r : dirty) {
+        if (r.start >= size)
+            break;
+        ranges.push_back(r.start);
+        ranges.push_back(std::min<uint32_t>(r.end, size));
+    }
+    dirty.clear();
+    return ranges;
+}
+
+struct SceneData
+{
+    ~SceneData();
+
+    void start_load_assets();
+    bool assets_ready() const;
+    void init_pipelines();
+    void init();
+    void set_file_contents(const char *data, size_t size);
+    void text_edited(uint32_t edit_start, uint32_t edit_end);
+    void select_range(uint32_t start, uint32_t end);
+    void replace_all();
+    void save();
+    void save_as();
+
+    bool initialized = false;
+    Document doc;
+    std::string filename;
+    std::string mime_type;
+
+    LineIndex line_index;
+    uint32_t cursor_pos = 0;
+    uint32_t selection_min = 0;
+    uint32_t selection_max = 0;
+    uint32_t edit_start = UINT32_MAX; // of the edits since the last frame
+    uint32_t edit_end = 0;
+    int goto_line = 1;
+    bool read_only_view = false;
+    struct {
+        bool pending = false;
+        uint32_t start;
+        uint32_t end;
+    } select;
+
+    TextSearch search;
+
+    struct {
+        std::vector<unsigned char> file; // while loading
+        unsigned char *pixels = nullptr; // decoded on a worker before the device exists, uploaded in init()
+        bool loading = false;
+        int width = 0;
+        int height = 0;
+        GpuHandle<WGPUTexture> texture;
+        GpuHandle<WGPUTextureView> view;
+        int downscale = 0; // halvings applied to stay within the GPU memory budget
+        bool show = false;
+    } image;
+    bool downscale_image();
+
+    bool show_gpu_memory = false;
+
+    Size last_fb_size;
+    glm::mat4 projection_matrix;
+    glm::mat4 view_matrix;
+    GpuHandle<WGPUShaderModule> color_material_shader_module;
+    struct {
+        GpuHandle<GpuHeapAllocation *> vbuf;
+        uint32_t vbuf_size;
+        GpuHandle<GpuHeapAllocation *> ubuf;
+        GpuHandle<WGPUBindGroupLayout> bgl;
+        GpuHandle<WGPUPipelineLayout> pl;
+        GpuHandle<WGPURenderPipeline> ps; // null until compiled
+        GpuHandle<WGPUBindGroup> bg;
+        float rotation = 0.0f;
+        StaticDraws draws;
+    } tri;
+
+    static const int MAX_INSTANCE_COUNT = 100000;
+    static const uint32_t INSTANCE_UBUF_SIZE = 80;
+    struct {
+        bool enabled = false;
+        bool indirect = false;
+        bool cpu_transforms = false;
+        bool cull = true;
+        bool move = false;
+        bool moved = false;
+        int count = MAX_INSTANCE_COUNT;
+        TransformsSoA transforms;
+        std::vector<float> base_x;
+        std::vector<float> phase;
+        std::vector<float> speed;
+        Frustum frustum;
+        LooseGrid grid;
+        CullStats cull_stats;
+        std::vector<uint32_t> visible;
+        TransformsSoA visible_transforms;
+        bool visible_identity = true;
+        int indirect_count = 0;
+        GpuHandle<WGPUShaderModule> shader_module;
+        GpuHandle<GpuHeapAllocation *> ubuf;
+        GpuHandle<WGPUBuffer> sbuf;
+        GpuHandle<WGPUBuffer> indirect_buf;
+        GpuHandle<WGPUBuffer> mvp_sbuf;
+        GpuHandle<WGPUBuffer> visible_sbuf;
+        GpuHandle<WGPUBindGroupLayout> bgl;
+        GpuHandle<WGPUPipelineLayout> pl;
+        GpuHandle<WGPURenderPipeline> ps;
+        GpuHandle<WGPURenderPipeline> mvp_ps;
+        GpuHandle<WGPUBindGroup> bg;
+    } inst;
+    double render_cpu_ms = 0.0;
+    float camera_yaw = 0.0f;
+
+    void init_instancing_pipelines();
+    void init_instancing();
+    void render_instances(WGPURenderPassEncoder pass, const glm::mat4 &view_projection_matrix);
+
+    // The benchmarks run as jobs, their results are only looked at while running is false
+    struct {
+        bool done = false;
+        bool running = false;
+        size_t counts[4] = { 1000, 10000, 100000, 1000000 };
+        glm::mat4 view_projection;
+        double simd_ms[4];
+        double glm_ms[4];
+        float max_error = 0.0f;
+    } transform_benchmark;
+
+    void run_transform_benchmark();
+    void transform_benchmark_job();
+
+    static const size_t JOB_BENCHMARK_TRANSFORMS = 1000000;
+    static const int JOB_BENCHMARK_DECODES = 32;
+    static const int JOB_BENCHMARK_RUNS = 5;
+    struct {
+        bool done = false;
+        bool running = false;
+        uint32_t threads[JOB_BENCHMARK_RUNS] = { 1, 2, 4, 8, 16 };
+        glm::mat4 view_projection;
+        std::vector<unsigned char> file; // test.png while running
+        double transform_ms[JOB_BENCHMARK_RUNS];
+        double decode_ms[JOB_BENCHMARK_RUNS];
+    } job_benchmark;
+
+    void run_job_benchmark();
+    void job_benchmark_job();
+
+    static const int BENCHMARK_DRAW_COUNT = 10000;
+    struct {
+        bool requested = false;
+        bool done = false;
+        double direct_ms;
+        double record_ms;
+        double replay_ms;
+    } encode_benchmark;
+
+    void run_encode_benchmark();
+};
+
+void SceneData::start_load_assets()
+{
+    // the file comes with the preload package, which is in memory before main() runs. It is
+    // read here since file system access from a worker gets proxied to the main thread.
+    if (!read_file("test.png", &image.file))
+        return;
+    image.loading = true;
+    // nothing looks at the pixels until loading is cleared
+    run_job_async([this] {
+        image.pixels = decode_image_from_memory(image.file.data(), image.file.size(), &image.width, &image.height);
+    }, [this] {
+        image.loading = false;
+        std::vector<unsigned char>().swap(image.file);
+        if (image.pixels)
+            startup_milestone("image decoded");
+    });
+}
+
+bool SceneData::assets_ready() const
+{
+    return !image.loading;
+}
+
+void SceneData::select_range(uint32_t start, uint32_t end)
+{
+    select.pending = true;
+    select.start = start;
+    select.end = end;
+}
+
+void SceneData::replace_all()
+{
+    const std::string &q(search.query);
+    const size_t replacement_size = strlen(search.replacement_input);
+    if (q.empty() || search.scanning() || search.matches.empty())
+        return;
+
+    // matches may overlap, replace them left to right like a sequence of single replacements would
+    std::vector<uint32_t> positions;
+    positions.reserve(search.matches.size());
+    size_t next_allowed = 0;
+    for (uint32_t pos : search.matches) {
+        if (pos >= next_allowed) {
+            positions.push_back(pos);
+            next_allowed = pos + q.size();
+        }
+    }
+
+    // build the new text in one go instead of applying the replacements one by one
+    const size_t new_size = doc.size - positions.size() * q.size() + positions.size() * replacement_size;
+    const size_t new_capacity = std::max(new_size + 1, doc.capacity);
+    std::unique_ptr<char[]> new_contents(new char[new_capacity]);
+    const char *src = doc.data.get();
+    char *dst = new_contents.get();
+    size_t src_pos = 0;
+    for (uint32_t pos : positions) {
+        memcpy(dst, src + src_pos, pos - src_pos);
+        dst += pos - src_pos;
+        memcpy(dst, search.replacement_input, replacement_size);
+        dst += replacement_size;
+        src_pos = pos + q.size();
+    }
+    memcpy(dst, src + src_pos, doc.size - src_pos);
+    new_contents[new_size] = '\0';
+
+    doc.data = std::move(new_contents);
+    doc.capacity = new_capacity;
+    doc.size = new_size;
+    doc.mark_dirty(positions.front(), std::max<uint32_t>(new_size, positions.front() + 1));
+    cursor_pos = std::min<uint32_t>(cursor_pos, new_size);
+    printf("Replaced %zu occurrences\n", positions.size());
+    text_edited(positions.front(), new_size);
+}
+
+void SceneData::set_file_contents(const char *data, size_t size)
+{
+    doc.assign(data, size);
+    touch_gui_glyphs(doc.data.get(), doc.data.get() + doc.size);
+    cursor_pos = selection_min = selection_max = 0;
+    line_index.build(doc.data.get(), doc.size);
+    search.restart();
+    search.set_query(doc.data.get(), doc.size, search.query_input);
+}
+
+void SceneData::text_edited(uint32_t edit_start, uint32_t edit_end)
+{
+    touch_gui_glyphs(doc.data.get() + edit_start, doc.data.get() + edit_end);
+    const size_t old_size = line_index.text_size;
+    line_index.update(doc.data.get(), doc.size, edit_start, edit_end);
+    search.text_edited(doc.data.get(), doc.size, old_size, edit_start, edit_end);
+}
+
+// The picker writes a new file with all the contents, edits made meanwhile get marked dirty
+// again. The file handle only changes on success: when it fails or is cancelled, the ranges
+// taken here are still missing from the previously opened file.
+void SceneData::save_as()
+{
+    if (!has_fs_api()) {
+        // a download, whether it happened is unknown, so the document stays modified
+        save_local_file(filename.c_str(), mime_type.c_str(), doc.data.get(), doc.size);
+        return;
+    }
+    doc.take_dirty_ranges();
+    save_local_file_fs_api(filename.c_str(), doc.data.get(), doc.size, [this](bool ok) {
+        if (!ok)
+            doc.mark_all_dirty();
+    });
+}
+
+void SceneData::save()
+{
+    if (!doc.dirty.empty()) {
+        std::vector<uint32_t> ranges = doc.take_dirty_ranges();
+        uint32_t bytes = 0;
+        for (size_t i = 0; i < ranges.size(); i += 2)
+            bytes += ranges[i + 1] - ranges[i];
+        printf("Saving %u bytes in %zu ranges\n", bytes, ranges.size() / 2);
+        save_local_file_ranges_fs_api(doc.data.get(), ranges, doc.size, [this](bool ok) {
+            if (!ok)
+                doc.mark_all_dirty();
+        });
+    }
+}
+
+// Called at startup, well before the first frame that needs them, so that the browser can
+// compile the pipelines in the background. Rendering skips whatever is not ready yet.
+void SceneData::init_pipelines()
+{
+    color_material_shader_module = create_shader_module(color_material_shaders);
+
+    WGPUBindGroupLayoutEntry bgl_entries[] = {
+        {
+            .binding = 0,
+            .visibility = WGPUShaderStage_Vertex | WGPUShaderStage_Fragment,
+            .buffer = {
+                .type = WGPUBufferBindingType_Uniform,
+                .minBindingSize = 64
+            }
+        }
+    };
+    WGPUBindGroupLayoutDescriptor bgl_desc = {
+        .entryCount = 1,
+        .entries = bgl_entries
+    };
+    tri.bgl = wgpuDeviceCreateBindGroupLayout(d.device, &bgl_desc);
+
+    WGPUPipelineLayoutDescriptor pl_desc = {
+        .bindGroupLayoutCount = 1,
+        .bindGroupLayouts = tri.bgl.ptr()
+    };
+    tri.pl = wgpuDeviceCreatePipelineLayout(d.device, &pl_desc);
+
+    WGPUDepthStencilState ds_state = {
+        .format = DEPTH_FORMAT,
+        .depthWriteEnabled = true,
+        .depthCompare = WGPUCompareFunction_Less
+    };
+
+    WGPUColorTargetState color0 = {
+        .format = WGPUTextureFormat_BGRA8Unorm,
+        .writeMask = WGPUColorWriteMask_All
+    };
+
+    WGPUFragmentState fs = {
+        .module = color_material_shader_module,
+        .entryPoint = "f_main",
+        .targetCount = 1,
+        .targets = &color0
+    };
+
+    WGPUVertexAttribute vertex_attrs[] = {
+        {
+            .format = WGPUVertexFormat_Float32x3,
+            .offset = 0,
+            .shaderLocation = 0
+        },
+        {
+            .format = WGPUVertexFormat_Float32x3,
+            .offset = 3 * sizeof(float),
+            .shaderLocation = 1
+        }
+    };
+    WGPUVertexBufferLayout vbuf_layout = {
+        .arrayStride = 6 * sizeof(float),
+        .attributeCount = 2,
+        .attributes = vertex_attrs
+    };
+
+    WGPURenderPipelineDescriptor ps_desc = {
+        .layout = tri.pl,
+        .vertex = {
+            .module = color_material_shader_module,
+            .entryPoint = "v_main",
+            .bufferCount = 1,
+            .buffers = &vbuf_layout
+        },
+        .primitive = {
+            .topology = WGPUPrimitiveTopology_TriangleList,
+            //.cullMode = WGPUCullMode_Back
+        },
+        .depthStencil = &ds_state,
+        .multisample = {
+            .count = 1,
+            .mask = 0xFFFFFFFF
+        },
+        .fragment = &fs
+    };
+    create_render_pipeline_async(ps_desc, [this](WGPURenderPipeline ps) { tri.ps = ps; });
+
+    init_instancing_pipelines();
 }
-)end";
-
-static float triangle_vertex_data[] = {
-     0.0f,   0.5f,  0.0f,    1.0f, 0.0f, 0.0f,
-    -0.5f,  -0.5f,  0.0f,    0.0f, 1.0f, 0.0f,
-     0.5f,  -0.5f,  0.0f,    0.0f, 0.0f, 1.0f
-};
 
-struct SceneData
+void SceneData::init()
 {
-    ~SceneData();
+    view_matrix = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 0.0f, -4.0f));
 
-    void start_load_assets();
-    bool assets_ready() const;
-    void init();
+    tri.vbuf_size = sizeof(triangle_vertex_data);
+    tri.vbuf = gpu_heap_alloc_with_data(GpuHeapKind::Vertex, tri.vbuf_size, triangle_vertex_data);
+    tri.ubuf = gpu_heap_alloc(GpuHeapKind::Uniform, 64);
 
-    bool initialized = false;
-    std::unique_ptr<char[]> file_contents;
-    size_t file_contents_alloc_size = 0;
-    std::string filename;
-    std::string mime_type;
+    WGPUBindGroupEntry bg_entry = {
+        .buffer = tri.ubuf->buffer,
+        .offset = tri.ubuf->offset,
+        .size = 64
+    };
+    WGPUBindGroupDescriptor bg_desc = {
+        .layout = tri.bgl,
+        .entryCount = 1,
+        .entries = &bg_entry
+    };
+    tri.bg = wgpuDeviceCreateBindGroup(d.device, &bg_desc);
 
-    Size last_fb_size;
-    glm::mat4 projection_matrix;
-    glm::mat4 view_matrix;
-    WGPUShaderModule color_material_shader_module;
-    struct {
-        WGPUBuffer vbuf;
-        uint32_t vbuf_size;
-        WGPUBuffer ubuf;
-        WGPUBindGroupLayout bgl;
-        WGPUPipelineLayout pl;
-        WGPURenderPipeline ps;
-        WGPUBindGroup bg;
-        float rotation = 0.0f;
-    } tri;
-};
+    init_instancing();
 
-void SceneData::start_load_assets()
-{
+    if (image.pixels) {
+        image.texture = create_texture_rgba8(image.pixels, image.width, image.height);
+        image.view = wgpuTextureCreateView(image.texture, nullptr);
+        stbi_image_free(image.pixels);
+        image.pixels = nullptr;
+        add_gpu_memory_evictor(this, [this] { return downscale_image(); });
+    }
 }
 
-bool SceneData::assets_ready() const
+// Replaces the image with one at half the current resolution, decoded again from the file.
+// Returns false when it is too small already.
+bool SceneData::downscale_image()
 {
+    const int level = image.downscale + 1;
+    if (!image.texture || (image.width >> level) < 32 || (image.height >> level) < 32)
+        return false;
+    int w, h;
+    unsigned char *pixels = decode_image("test.png", &w, &h);
+    if (!pixels)
+        return false;
+
+    // box filter
+    const int f = 1 << level;
+    const int dw = w >> level;
+    const int dh = h >> level;
+    std::vector<unsigned char> small(size_t(dw) * dh * 4);
+    for (int y = 0; y < dh; ++y) {
+        for (int x = 0; x < dw; ++x) {
+            for (int c = 0; c < 4; ++c) {
+                uint32_t sum = 0;
+                for (int sy = 0; sy < f; ++sy) {
+                    for (int sx = 0; sx < f; ++sx)
+                        sum += pixels[((size_t(y) * f + sy) * w + size_t(x) * f + sx) * 4 + c];
+                }
+                small[(size_t(y) * dw + x) * 4 + c] = uint8_t(sum / (f * f));
+            }
+        }
+    }
+    stbi_image_free(pixels);
+
+    forget_gui_texture(image.view);
+    image.texture = create_texture_rgba8(small.data(), dw, dh);
+    image.view = wgpuTextureCreateView(image.texture, nullptr);
+    image.downscale = level;
+    printf("Downscaled test.png to %dx%d to stay within the GPU memory budget\n", dw, dh);
     return true;
 }
 
-void SceneData::init()
+// GPU objects are released by their handles
+SceneData::~SceneData()
 {
-    view_matrix = glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 0.0f, -4.0f));
-
-    color_material_shader_module = create_shader_module(color_material_shaders);
+    remove_gpu_memory_evictors(this);
+    tri.draws.bundle.reset();
+    if (image.view)
+        forget_gui_texture(image.view);
+    if (image.pixels)
+        stbi_image_free(image.pixels);
+}
 
-    tri.vbuf_size = sizeof(triangle_vertex_data);
-    tri.vbuf = create_buffer_with_data(WGPUBufferUsage_Vertex, tri.vbuf_size, triangle_vertex_data);
-    tri.ubuf = create_uniform_buffer(64);
+void SceneData::init_instancing_pipelines()
+{
+    inst.shader_module = create_shader_module(instanced_color_material_shaders);
 
     WGPUBindGroupLayoutEntry bgl_entries[] = {
         {
             .binding = 0,
-            .visibility = WGPUShaderStage_Vertex | WGPUShaderStage_Fragment,
+            .visibility = WGPUShaderStage_Vertex,
             .buffer = {
                 .type = WGPUBufferBindingType_Uniform,
+                .minBindingSize = INSTANCE_UBUF_SIZE
+            }
+        },
+        {
+            .binding = 1,
+            .visibility = WGPUShaderStage_Vertex,
+            .buffer = {
+                .type = WGPUBufferBindingType_ReadOnlyStorage,
+                .minBindingSize = sizeof(InstanceData)
+            }
+        },
+        {
+            .binding = 2,
+            .visibility = WGPUShaderStage_Vertex,
+            .buffer = {
+                .type = WGPUBufferBindingType_ReadOnlyStorage,
                 .minBindingSize = 64
             }
+        },
+        {
+            .binding = 3,
+            .visibility = WGPUShaderStage_Vertex,
+            .buffer = {
+                .type = WGPUBufferBindingType_ReadOnlyStorage,
+                .minBindingSize = sizeof(uint32_t)
+            }
         }
     };
     WGPUBindGroupLayoutDescriptor bgl_desc = {
-        .entryCount = 1,
+        .entryCount = 4,
         .entries = bgl_entries
     };
-    tri.bgl = wgpuDeviceCreateBindGroupLayout(d.device, &bgl_desc);
+    inst.bgl = wgpuDeviceCreateBindGroupLayout(d.device, &bgl_desc);
 
     WGPUPipelineLayoutDescriptor pl_desc = {
         .bindGroupLayoutCount = 1,
-        .bindGroupLayouts = &tri.bgl
+        .bindGroupLayouts = inst.bgl.ptr()
     };
-    tri.pl = wgpuDeviceCreatePipelineLayout(d.device, &pl_desc);
+    inst.pl = wgpuDeviceCreatePipelineLayout(d.device, &pl_desc);
 
     WGPUDepthStencilState ds_state = {
-        .format = WGPUTextureFormat_Depth24PlusStencil8,
+        .format = DEPTH_FORMAT,
         .depthWriteEnabled = true,
         .depthCompare = WGPUCompareFunction_Less
     };
@@ -1505,7 +5473,7 @@ void SceneData::init()
     };
 
     WGPUFragmentState fs = {
-        .module = color_material_shader_module,
+        .module = inst.shader_module,
         .entryPoint = "f_main",
         .targetCount = 1,
         .targets = &color0
@@ -1530,16 +5498,15 @@ void SceneData::init()
     };
 
     WGPURenderPipelineDescriptor ps_desc = {
-        .layout = tri.pl,
+        .layout = inst.pl,
         .vertex = {
-            .module = color_material_shader_module,
+            .module = inst.shader_module,
             .entryPoint = "v_main",
             .bufferCount = 1,
             .buffers = &vbuf_layout
         },
         .primitive = {
-            .topology = WGPUPrimitiveTopology_TriangleList,
-            //.cullMode = WGPUCullMode_Back
+            .topology = WGPUPrimitiveTopology_TriangleList
         },
         .depthStencil = &ds_state,
         .multisample = {
@@ -1548,43 +5515,450 @@ void SceneData::init()
         },
         .fragment = &fs
     };
-    tri.ps = wgpuDeviceCreateRenderPipeline(d.device, &ps_desc);
+    create_render_pipeline_async(ps_desc, [this](WGPURenderPipeline ps) { inst.ps = ps; });
+    ps_desc.vertex.entryPoint = "v_main_mvp";
+    create_render_pipeline_async(ps_desc, [this](WGPURenderPipeline ps) { inst.mvp_ps = ps; });
+}
+
+void SceneData::init_instancing()
+{
+    // a fixed pseudo-random cloud in front of the camera, the count only limits the draw
+    std::vector<InstanceData> instances(MAX_INSTANCE_COUNT);
+    uint32_t seed = 1;
+    auto rnd = [&seed] {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    for (InstanceData &i : instances) {
+        i.position_scale[0] = rnd() * 40.0f - 20.0f;
+        i.position_scale[1] = rnd() * 24.0f - 12.0f;
+        i.position_scale[2] = -rnd() * 60.0f;
+        i.position_scale[3] = 0.1f + rnd() * 0.2f;
+        i.phase_speed[0] = rnd() * 6.2831853f;
+        i.phase_speed[1] = 0.5f + rnd() * 2.0f;
+    }
+    inst.sbuf = create_buffer_with_data(WGPUBufferUsage_Storage, instances.size() * sizeof(InstanceData), instances.data());
+
+    // the same as input for batch_mvp
+    inst.transforms.resize(MAX_INSTANCE_COUNT);
+    inst.phase.resize(MAX_INSTANCE_COUNT);
+    inst.speed.resize(MAX_INSTANCE_COUNT);
+    for (int i = 0; i < MAX_INSTANCE_COUNT; ++i) {
+        inst.transforms.x[i] = instances[i].position_scale[0];
+        inst.transforms.y[i] = instances[i].position_scale[1];
+        inst.transforms.z[i] = instances[i].position_scale[2];
+        inst.transforms.scale[i] = instances[i].position_scale[3];
+        inst.phase[i] = instances[i].phase_speed[0];
+        inst.speed[i] = instances[i].phase_speed[1];
+    }
+    inst.base_x = inst.transforms.x;
+    inst.mvp_sbuf = create_buffer(WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst, MAX_INSTANCE_COUNT * 64);
+
+    // the triangle fits in a sphere of 0.71 at scale 1, scale is at most 0.3 and moving
+    // objects stay within 3 units of their original x
+    inst.grid.init(inst.transforms, MAX_INSTANCE_COUNT, 4.0f, 3.0f, 0.71f * 0.3f);
+    inst.visible.resize(MAX_INSTANCE_COUNT);
+    for (int i = 0; i < MAX_INSTANCE_COUNT; ++i)
+        inst.visible[i] = i;
+    inst.visible_sbuf = create_buffer_with_data(WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst, MAX_INSTANCE_COUNT * sizeof(uint32_t), inst.visible.data());
+    inst.ubuf = gpu_heap_alloc(GpuHeapKind::Uniform, INSTANCE_UBUF_SIZE);
+    inst.indirect_buf = create_buffer(WGPUBufferUsage_Indirect | WGPUBufferUsage_CopyDst, 4 * sizeof(uint32_t));
 
-    WGPUBindGroupEntry bg_entry = {
-        .buffer = tri.ubuf,
-        .offset = 0,
-        .size = 64
+    WGPUBindGroupEntry bg_entries[] = {
+        {
+            .binding = 0,
+            .buffer = inst.ubuf->buffer,
+            .offset = inst.ubuf->offset,
+            .size = INSTANCE_UBUF_SIZE
+        },
+        {
+            .binding = 1,
+            .buffer = inst.sbuf,
+            .size = MAX_INSTANCE_COUNT * sizeof(InstanceData)
+        },
+        {
+            .binding = 2,
+            .buffer = inst.mvp_sbuf,
+            .size = MAX_INSTANCE_COUNT * 64
+        },
+        {
+            .binding = 3,
+            .buffer = inst.visible_sbuf,
+            .size = MAX_INSTANCE_COUNT * sizeof(uint32_t)
+        }
     };
     WGPUBindGroupDescriptor bg_desc = {
-        .layout = tri.bgl,
-        .entryCount = 1,
-        .entries = &bg_entry
+        .layout = inst.bgl,
+        .entryCount = 4,
+        .entries = bg_entries
     };
-    tri.bg = wgpuDeviceCreateBindGroup(d.device, &bg_desc);
+    inst.bg = wgpuDeviceCreateBindGroup(d.device, &bg_desc);
 }
 
-SceneData::~SceneData()
+void SceneData::render_instances(WGPURenderPassEncoder pass, const glm::mat4 &view_projection_matrix)
+{
+    const float time = glm::radians(tri.rotation);
+    const double t0 = emscripten_get_now();
+    inst.cull_stats = {};
+
+    // drifting along x, only with CPU transforms since the GPU path reads static positions
+    const bool move = inst.cpu_transforms && inst.move;
+    if (move || inst.moved) {
+        for (int i = 0; i < inst.count; ++i) {
+            const float x = inst.base_x[i] + (move ? 3.0f * sinf(time * 0.3f + inst.phase[i]) : 0.0f);
+            inst.transforms.x[i] = x;
+            const uint32_t cell = inst.grid.cell_of[i];
+            inst.grid.move(i, x, inst.transforms.y[i], inst.transforms.z[i]);
+            inst.cull_stats.objects_moved += inst.grid.cell_of[i] != cell;
+        }
+        inst.moved = move;
+    }
+
+    uint32_t draw_count = inst.count;
+    if (inst.cull) {
+        inst.frustum.set(view_projection_matrix);
+        inst.grid.cull(inst.frustum, inst.transforms, 0.71f, inst.count, &inst.visible, &inst.cull_stats);
+        draw_count = inst.visible.size();
+    }
+    inst.cull_stats.ms = emscripten_get_now() - t0;
+
+    if (inst.cpu_transforms) {
+        const TransformsSoA *transforms = &inst.transforms;
+        if (inst.cull) {
+            TransformsSoA &v(inst.visible_transforms);
+            v.resize(draw_count);
+            for (uint32_t i = 0; i < draw_count; ++i) {
+                const uint32_t id = inst.visible[i];
+                v.x[i] = inst.transforms.x[id];
+                v.y[i] = inst.transforms.y[id];
+                v.z[i] = inst.transforms.z[id];
+                v.scale[i] = inst.transforms.scale[id];
+                v.angle[i] = inst.phase[id] + time * inst.speed[id];
+            }
+            transforms = &v;
+        } else {
+            for (int i = 0; i < inst.count; ++i)
+                inst.transforms.angle[i] = inst.phase[i] + time * inst.speed[i];
+        }
+        const uint32_t size = draw_count * 64;
+        if (size) {
+            UBufStagingArea u = next_ubuf_staging_area_for_current_frame(size);
+            float *out = reinterpret_cast<float *>(u.p);
+            const glm::mat4 *vp = &view_projection_matrix;
+            parallel_for(draw_count, TRANSFORM_JOB_MIN_CHUNK, [transforms, vp, out](size_t first, size_t n) {
+                batch_mvp(*transforms, first, n, *vp, out + first * 16);
+            });
+            enqueue_ubuf_staging_copy(u, inst.mvp_sbuf, size);
+        }
+    } else {
+        UBufStagingArea u = next_ubuf_staging_area_for_current_frame();
+        memcpy(u.p, &view_projection_matrix[0], 64);
+        memcpy(u.p + 64, &time, sizeof(float));
+        enqueue_ubuf_staging_copy(u, inst.ubuf->buffer, INSTANCE_UBUF_SIZE, 0, inst.ubuf->offset);
+        // the shader goes through the visible list, which is the identity without culling
+        if (inst.cull) {
+            const uint32_t size = draw_count * sizeof(uint32_t);
+            if (size) {
+                UBufStagingArea v = next_ubuf_staging_area_for_current_frame(size);
+                memcpy(v.p, inst.visible.data(), size);
+                enqueue_ubuf_staging_copy(v, inst.visible_sbuf, size);
+            }
+            inst.visible_identity = false;
+        } else if (!inst.visible_identity) {
+            std::vector<uint32_t> identity(MAX_INSTANCE_COUNT);
+            for (int i = 0; i < MAX_INSTANCE_COUNT; ++i)
+                identity[i] = i;
+            wgpuQueueWriteBuffer(d.queue, inst.visible_sbuf, 0, identity.data(), identity.size() * sizeof(uint32_t));
+            inst.visible_identity = true;
+        }
+    }
+
+    if (!draw_count)
+        return;
+    wgpuRenderPassEncoderSetPipeline(pass, inst.cpu_transforms ? inst.mvp_ps : inst.ps);
+    wgpuRenderPassEncoderSetBindGroup(pass, 0, inst.bg, 0, nullptr);
+    wgpuRenderPassEncoderSetVertexBuffer(pass, 0, tri.vbuf->buffer, tri.vbuf->offset, tri.vbuf_size);
+    if (inst.indirect) {
+        // vertexCount, instanceCount, firstVertex, firstInstance
+        if (inst.indirect_count != int(draw_count)) {
+            const uint32_t args[4] = { 3, draw_count, 0, 0 };
+            wgpuQueueWriteBuffer(d.queue, inst.indirect_buf, 0, args, sizeof(args));
+            inst.indirect_count = draw_count;
+        }
+        wgpuRenderPassEncoderDrawIndirect(pass, inst.indirect_buf, 0);
+    } else {
+        wgpuRenderPassEncoderDraw(pass, 3, draw_count, 0, 0);
+    }
+}
+
+// batch_mvp against the equivalent glm code, at 1k to 1M objects
+static void random_transforms(TransformsSoA *t, size_t count)
+{
+    t->resize(count);
+    uint32_t seed = 7;
+    auto rnd = [&seed] {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) * (1.0f / 16777216.0f);
+    };
+    for (size_t i = 0; i < count; ++i) {
+        t->x[i] = rnd() * 100.0f - 50.0f;
+        t->y[i] = rnd() * 100.0f - 50.0f;
+        t->z[i] = rnd() * 100.0f - 50.0f;
+        t->angle[i] = rnd() * 20.0f - 10.0f;
+        t->scale[i] = 0.1f + rnd();
+    }
+}
+
+// Largest difference between batch_mvp and batch_mvp_glm allowed by the benchmark, relative
+// to 1 + |element| so that it is absolute for small values: a few float ulps, since the
+// polynomial sine and cosine are within about 1e-7 of the library ones
+static const float TRANSFORM_MAX_ERROR = 1e-6f;
+
+// Starts the benchmark on a worker (without worker threads it still runs on the main
+// thread, from the completion queue), the results show up when it is done
+void SceneData::run_transform_benchmark()
 {
-    wgpuBindGroupRelease(tri.bg);
-    wgpuRenderPipelineRelease(tri.ps);
-    wgpuPipelineLayoutRelease(tri.pl);
-    wgpuBindGroupLayoutRelease(tri.bgl);
-    wgpuBufferDestroy(tri.ubuf);
-    wgpuBufferDestroy(tri.vbuf);
-    wgpuShaderModuleRelease(color_material_shader_module);
+    if (transform_benchmark.running || job_benchmark.running)
+        return;
+    transform_benchmark.running = true;
+    transform_benchmark.view_projection = projection_matrix * view_matrix;
+    run_job_async([this] { transform_benchmark_job(); }, [this] {
+        transform_benchmark.running = false;
+        transform_benchmark.done = true;
+    });
 }
 
-void Scene::init()
+// The buffers (about 85 MB at the largest count) only exist while this runs, both versions
+// write to the same output and are compared piecewise afterwards
+void SceneData::transform_benchmark_job()
+{
+    const size_t max_count = transform_benchmark.counts[3];
+    TransformsSoA t;
+    random_transforms(&t, max_count);
+    std::vector<float> out(max_count * 16);
+    const glm::mat4 &view_projection(transform_benchmark.view_projection);
+    for (int i = 0; i < 4; ++i) {
+        const size_t count = transform_benchmark.counts[i];
+        const double t0 = emscripten_get_now();
+        batch_mvp(t, 0, count, view_projection, out.data());
+        const double t1 = emscripten_get_now();
+        batch_mvp_glm(t, 0, count, view_projection, out.data());
+        const double t2 = emscripten_get_now();
+        transform_benchmark.simd_ms[i] = t1 - t0;
+        transform_benchmark.glm_ms[i] = t2 - t1;
+        printf("%zu transforms: SIMD %.3f ms, glm %.3f ms\n", count, t1 - t0, t2 - t1);
+    }
+    static const size_t CHECK_CHUNK = 1024;
+    std::vector<float> simd(CHECK_CHUNK * 16);
+    std::vector<float> ref(CHECK_CHUNK * 16);
+    float max_error = 0.0f;
+    for (size_t first = 0; first < max_count; first += CHECK_CHUNK) {
+        const size_t n = std::min(CHECK_CHUNK, max_count - first);
+        batch_mvp(t, first, n, view_projection, simd.data());
+        batch_mvp_glm(t, first, n, view_projection, ref.data());
+        for (size_t i = 0; i < n * 16; ++i)
+            max_error = std::max(max_error, fabsf(simd[i] - ref[i]) / (1.0f + fabsf(ref[i])));
+    }
+    transform_benchmark.max_error = max_error;
+    printf("Max error against glm: %g (%s, bound %g)\n", max_error, max_error <= TRANSFORM_MAX_ERROR ? "ok" : "FAILED", TRANSFORM_MAX_ERROR);
+}
+
+// batch_mvp over JOB_BENCHMARK_TRANSFORMS objects and JOB_BENCHMARK_DECODES decodes of
+// test.png, split into at most 1, 2, 4, 8 and 16 pieces so that no more threads than that
+// can work on them
+void SceneData::run_job_benchmark()
+{
+    if (transform_benchmark.running || job_benchmark.running)
+        return;
+    // read here since file system access from a worker gets proxied to the main thread
+    if (!read_file("test.png", &job_benchmark.file))
+        return;
+    job_benchmark.running = true;
+    job_benchmark.view_projection = projection_matrix * view_matrix;
+    // the job's own thread takes part in the parallel_for calls, so the thread counts hold
+    run_job_async([this] { job_benchmark_job(); }, [this] {
+        std::vector<unsigned char>().swap(job_benchmark.file);
+        job_benchmark.running = false;
+        job_benchmark.done = true;
+    });
+}
+
+void SceneData::job_benchmark_job()
+{
+    TransformsSoA t;
+    random_transforms(&t, JOB_BENCHMARK_TRANSFORMS);
+    std::vector<float> out(JOB_BENCHMARK_TRANSFORMS * 16);
+    std::atomic<uint32_t> decode_failures { 0 };
+
+    const TransformsSoA *tp = &t;
+    const glm::mat4 *vp = &job_benchmark.view_projection;
+    float *outp = out.data();
+    const std::vector<unsigned char> *filep = &job_benchmark.file;
+    std::atomic<uint32_t> *failures = &decode_failures;
+    for (int i = 0; i < JOB_BENCHMARK_RUNS; ++i) {
+        const uint32_t threads = job_benchmark.threads[i];
+        const double t0 = emscripten_get_now();
+        parallel_for(JOB_BENCHMARK_TRANSFORMS, TRANSFORM_JOB_MIN_CHUNK, [tp, vp, outp](size_t first, size_t n) {
+            batch_mvp(*tp, first, n, *vp, outp + first * 16);
+        }, threads);
+        const double t1 = emscripten_get_now();
+        parallel_for(JOB_BENCHMARK_DECODES, 1, [filep, failures](size_t first, size_t n) {
+            for (size_t j = 0; j < n; ++j) {
+                int w, h;
+                unsigned char *pixels = decode_image_from_memory(filep->data(), filep->size(), &w, &h);
+                if (pixels)
+                    stbi_image_free(pixels);
+                else
+                    failures->fetch_add(1, std::memory_order_relaxed);
+            }
+        }, threads);
+        const double t2 = emscripten_get_now();
+        job_benchmark.transform_ms[i] = t1 - t0;
+        job_benchmark.decode_ms[i] = t2 - t1;
+        printf("%2u thread(s): %zu transforms %.3f ms (%.2fx), %d decodes %.3f ms (%.2fx)\n", threads,
+               JOB_BENCHMARK_TRANSFORMS, t1 - t0, job_benchmark.transform_ms[0] / (t1 - t0),
+               JOB_BENCHMARK_DECODES, t2 - t1, job_benchmark.decode_ms[0] / (t2 - t1));
+    }
+    if (decode_failures)
+        printf("%u decodes failed\n", decode_failures.load());
+}
+
+// Compares the CPU cost of encoding BENCHMARK_DRAW_COUNT draws into a render pass against
+// recording them into a render bundle and replaying that. The pass renders to 1x1 pooled
+// attachments and its command encoder is never finished, so nothing reaches the GPU.
+void SceneData::run_encode_benchmark()
+{
+    WGPURenderPassColorAttachment attachment = {
+        .view = acquire_attachment(WGPUTextureFormat_BGRA8Unorm, Size { 1, 1 }),
+        .loadOp = WGPULoadOp_Clear,
+        .storeOp = WGPUStoreOp_Discard
+    };
+    WGPURenderPassDepthStencilAttachment depthStencilAttachment = {
+        .view = acquire_attachment(DEPTH_FORMAT, Size { 1, 1 }),
+        .depthLoadOp = WGPULoadOp_Clear,
+        .depthStoreOp = WGPUStoreOp_Discard,
+        .depthClearValue = 1.0f,
+        .stencilLoadOp = DEPTH_ATTACHMENT_STENCIL ? WGPULoadOp_Clear : WGPULoadOp_Undefined,
+        .stencilStoreOp = DEPTH_ATTACHMENT_STENCIL ? WGPUStoreOp_Discard : WGPUStoreOp_Undefined
+    };
+    WGPURenderPassDescriptor renderpass = {
+        .colorAttachmentCount = 1,
+        .colorAttachments = &attachment,
+        .depthStencilAttachment = &depthStencilAttachment
+    };
+    WGPUCommandEncoder command_encoder = wgpuDeviceCreateCommandEncoder(d.device, nullptr);
+    WGPURenderPassEncoder pass = wgpuCommandEncoderBeginRenderPass(command_encoder, &renderpass);
+
+    const double t0 = emscripten_get_now();
+    for (int i = 0; i < BENCHMARK_DRAW_COUNT; ++i) {
+        wgpuRenderPassEncoderSetPipeline(pass, tri.ps);
+        wgpuRenderPassEncoderSetBindGroup(pass, 0, tri.bg, 0, nullptr);
+        wgpuRenderPassEncoderSetVertexBuffer(pass, 0, tri.vbuf->buffer, tri.vbuf->offset, tri.vbuf_size);
+        wgpuRenderPassEncoderDraw(pass, 3, 1, 0, 0);
+    }
+    const double t1 = emscripten_get_now();
+    WGPURenderBundleEncoder encoder = begin_render_bundle();
+    for (int i = 0; i < BENCHMARK_DRAW_COUNT; ++i) {
+        wgpuRenderBundleEncoderSetPipeline(encoder, tri.ps);
+        wgpuRenderBundleEncoderSetBindGroup(encoder, 0, tri.bg, 0, nullptr);
+        wgpuRenderBundleEncoderSetVertexBuffer(encoder, 0, tri.vbuf->buffer, tri.vbuf->offset, tri.vbuf_size);
+        wgpuRenderBundleEncoderDraw(encoder, 3, 1, 0, 0);
+    }
+    WGPURenderBundle bundle = end_render_bundle(encoder);
+    const double t2 = emscripten_get_now();
+    wgpuRenderPassEncoderExecuteBundles(pass, 1, &bundle);
+    const double t3 = emscripten_get_now();
+    wgpuRenderBundleRelease(bundle);
+    end_render_pass(pass);
+    wgpuCommandEncoderRelease(command_encoder);
+
+    encode_benchmark.direct_ms = t1 - t0;
+    encode_benchmark.record_ms = t2 - t1;
+    encode_benchmark.replay_ms = t3 - t2;
+    encode_benchmark.requested = false;
+    encode_benchmark.done = true;
+    printf("%d draws: direct encode %.3f ms, bundle record %.3f ms, bundle replay %.3f ms\n", BENCHMARK_DRAW_COUNT,
+           encode_benchmark.direct_ms, encode_benchmark.record_ms, encode_benchmark.replay_ms);
+}
+
+void Scene::start_loading()
 {
     sd.reset(new SceneData);
     sd->start_load_assets();
 }
 
+void Scene::init()
+{
+    // pipelines are requested right away, everything else waits for the first render
+    sd->init_pipelines();
+}
+
 void Scene::cleanup()
 {
     sd.reset();
 }
 
+static int text_edit_callback(ImGuiInputTextCallbackData *data)
+{
+    SceneData *sd = static_cast<SceneData *>(data->UserData);
+    Document &doc(sd->doc);
+    switch (data->EventFlag) {
+    case ImGuiInputTextFlags_CallbackResize:
+        doc.reserve(std::max<size_t>(data->BufSize, doc.capacity * 2));
+        data->Buf = doc.data.get();
+        return 0;
+    case ImGuiInputTextFlags_CallbackEdit:
+    {
+        // edits happen at the selection (or cursor) as it was before, except for undo/redo
+        const ImGuiIO &io(ImGui::GetIO());
+        const bool undo_redo = (io.KeyCtrl || io.KeySuper) && (ImGui::IsKeyDown(ImGuiKey_Z) || ImGui::IsKeyDown(ImGuiKey_Y));
+        const uint32_t new_size = data->BufTextLen;
+        const uint32_t start = undo_redo ? 0 : std::min<uint32_t>(sd->selection_min, data->CursorPos);
+        const uint32_t end = new_size != doc.size ? new_size : std::max<uint32_t>(sd->selection_max, data->CursorPos);
+        doc.mark_dirty(start, std::max(end, start + 1));
+        // where the changed text ends now: the cursor is left after what was inserted.
+        // The range of an earlier edit in the same frame moves with this one.
+        uint32_t edit_end = sd->edit_end;
+        if (edit_end > start)
+            edit_end = uint32_t(std::max<int64_t>(start, int64_t(edit_end) + new_size - int64_t(doc.size)));
+        sd->edit_end = std::max(edit_end, undo_redo ? new_size : std::max<uint32_t>(start, data->CursorPos));
+        // the new text is only copied into doc.data after the callback
+        doc.size = new_size;
+        sd->edit_start = std::min(sd->edit_start, start);
+        break;
+    }
+    default:
+        break;
+    }
+    if (sd->select.pending) {
+        sd->select.pending = false;
+        data->SelectionStart = sd->select.start;
+        data->CursorPos = data->SelectionEnd = sd->select.end;
+    }
+    sd->cursor_pos = data->CursorPos;
+    sd->selection_min = std::min({ data->CursorPos, data->SelectionStart, data->SelectionEnd });
+    sd->selection_max = std::max({ data->CursorPos, data->SelectionStart, data->SelectionEnd });
+    return 0;
+}
+
+// The editor draws the text itself, so the lines it can be showing are touched every frame
+// to keep their glyphs from being evicted. It scrolls to keep the cursor in view, so that is
+// one editor height of lines either side of the cursor line. Lines scrolled to with the mouse
+// wheel away from the cursor were touched on load or edit and only fall back once evicted.
+static void touch_text_edit_glyphs(const SceneData &sd, float editor_height)
+{
+    const LineIndex &index(sd.line_index);
+    if (!index.line_count())
+        return;
+    const uint32_t visible = uint32_t(std::max(0.0f, editor_height) / ImGui::GetTextLineHeight()) + 1;
+    const uint32_t cursor_line = index.line_for_offset(std::min<uint32_t>(sd.cursor_pos, sd.doc.size));
+    const uint32_t first = cursor_line - std::min(cursor_line, visible);
+    const uint32_t last = cursor_line + visible + 1;
+    const char *text = sd.doc.data.get();
+    const uint32_t end = last < index.line_count() ? index.line_starts[last] : uint32_t(sd.doc.size);
+    touch_gui_glyphs(text + index.line_starts[first], text + end);
+}
+
 void Scene::gui()
 {
     ImGuiIO &io(ImGui::GetIO());
@@ -1602,50 +5976,362 @@ void Scene::gui()
     }
     ImGui::SameLine();
     if (ImGui::Button("New")) {
-        sd->file_contents_alloc_size = 4096;
-        sd->file_contents.reset(new char[sd->file_contents_alloc_size]);
-        sd->file_contents[0] = '\0';
+        sd->set_file_contents("", 0);
         sd->filename = "document.txt";
         sd->mime_type = "text/plain";
+        forget_fs_api_file_handle();
     }
     ImGui::SameLine();
     if (ImGui::Button("Open local text file")) {
         if (has_fs_api()) {
             load_local_file_fs_api([this](const char *filename, char *data, size_t size) {
                 printf("load callback: %s %p %lu\n", filename, data, size);
-                sd->file_contents_alloc_size = size * 2;
-                sd->file_contents.reset(new char[sd->file_contents_alloc_size]);
-                memcpy(sd->file_contents.get(), data, size);
-                sd->file_contents[size] = '\0';
+                sd->set_file_contents(data, size);
                 sd->filename = filename;
             });
         } else {
+            forget_fs_api_file_handle();
             load_local_file("text/*", [this](const char *filename, const char *mime_type, char *data, size_t size) {
                 printf("load callback: %s %s %p %lu\n", filename, mime_type, data, size);
-                sd->file_contents_alloc_size = size * 2;
-                sd->file_contents.reset(new char[sd->file_contents_alloc_size]);
-                memcpy(sd->file_contents.get(), data, size);
-                sd->file_contents[size] = '\0';
+                sd->set_file_contents(data, size);
                 sd->filename = filename;
                 sd->mime_type = mime_type;
             });
         }
     }
-    if (sd->file_contents) {
-        ImGui::SameLine();
-        if (ImGui::Button("Save As")) {
-            if (has_fs_api())
-                save_local_file_fs_api(sd->filename.c_str(), sd->file_contents.get(), strlen(sd->file_contents.get()));
-            else
-                save_local_file(sd->filename.c_str(), sd->mime_type.c_str(), sd->file_contents.get(), strlen(sd->file_contents.get()));
+    ImGui::SameLine();
+    ImGui::Checkbox("Images", &sd->image.show);
+    ImGui::SameLine();
+    ImGui::Checkbox("GPU memory", &sd->show_gpu_memory);
+    if (sd->doc.data) {
+        Document &doc(sd->doc);
+        if (has_fs_api() && has_fs_api_file_handle()) {
+            ImGui::SameLine();
+            ImGui::BeginDisabled(doc.dirty.empty());
+            if (ImGui::Button("Save"))
+                sd->save();
+            ImGui::EndDisabled();
         }
+        ImGui::SameLine();
+        if (ImGui::Button("Save As"))
+            sd->save_as();
         ImGui::TextUnformatted(sd->filename.c_str());
         ImGui::SameLine();
         ImGui::TextUnformatted(sd->mime_type.c_str());
-        ImGui::InputTextMultiline("##textedit", sd->file_contents.get(), sd->file_contents_alloc_size, ImVec2(-FLT_MIN, -FLT_MIN));
+        ImGui::SameLine();
+        ImGui::Text("| %zu bytes%s", doc.size, doc.dirty.empty() ? "" : " (modified)");
+
+        const LineIndex &index(sd->line_index);
+        const uint32_t cursor_line = index.line_for_offset(sd->cursor_pos);
+        ImGui::Text("Ln %u, Col %u | %u lines | %s | %s", cursor_line + 1, sd->cursor_pos - index.line_starts[cursor_line] + 1,
+                    index.line_count(), line_endings_name(index.line_endings()), index.utf8_valid() ? "UTF-8" : "Not UTF-8");
+        ImGui::SameLine();
+        ImGui::SetNextItemWidth(120);
+        bool goto_line = ImGui::InputInt("##gotoline", &sd->goto_line, 0, 0, ImGuiInputTextFlags_EnterReturnsTrue);
+        ImGui::SameLine();
+        goto_line |= ImGui::Button("Go to line");
+        if (goto_line) {
+            sd->goto_line = std::clamp<int>(sd->goto_line, 1, index.line_count());
+            const uint32_t pos = index.line_starts[sd->goto_line - 1];
+            sd->select_range(pos, pos);
+        }
+        ImGui::SameLine();
+        ImGui::Checkbox("Read-only view", &sd->read_only_view);
+        ImGui::SameLine();
+        ImGui::SetNextItemWidth(120);
+        // the font atlas is a distance field, no rebake needed
+        ImGui::SliderFloat("Text scale", &io.FontGlobalScale, 0.5f, 3.0f, "%.2f");
+
+        TextSearch &search(sd->search);
+        ImGui::SetNextItemWidth(200);
+        if (ImGui::InputTextWithHint("##find", "Find", search.query_input, sizeof(search.query_input)))
+            search.set_query(doc.data.get(), doc.size, search.query_input);
+        ImGui::SameLine();
+        ImGui::SetNextItemWidth(200);
+        ImGui::InputTextWithHint("##replace", "Replace with", search.replacement_input, sizeof(search.replacement_input));
+        search.step(doc.data.get(), doc.size, 2.0);
+        search.update_markers(index);
+        const std::vector<uint32_t> &matches(search.matches);
+        ImGui::SameLine();
+        if (ImGui::ArrowButton("##prev", ImGuiDir_Up) && !matches.empty()) {
+            auto it = std::lower_bound(matches.begin(), matches.end(), sd->cursor_pos - std::min<uint32_t>(sd->cursor_pos, search.query.size()));
+            const uint32_t pos = it == matches.begin() ? matches.back() : *(it - 1);
+            sd->select_range(pos, pos + search.query.size());
+        }
+        ImGui::SameLine();
+        if (ImGui::ArrowButton("##next", ImGuiDir_Down) && !matches.empty()) {
+            auto it = std::lower_bound(matches.begin(), matches.end(), sd->cursor_pos);
+            const uint32_t pos = it == matches.end() ? matches.front() : *it;
+            sd->select_range(pos, pos + search.query.size());
+        }
+        ImGui::SameLine();
+        // clicking the button takes the focus away from the editor, so the buffer can be replaced directly
+        if (ImGui::Button("Replace all"))
+            sd->replace_all();
+        ImGui::SameLine();
+        if (search.scanning())
+            ImGui::Text("%zu matches (searching %d%%)", matches.size(), int(search.scan_pos * 100 / search.scan_end));
+        else if (!search.query.empty())
+            ImGui::Text("%zu matches (%.2f ms)", matches.size(), search.last_step_ms);
+
+        if (sd->read_only_view) {
+            // only the visible lines are submitted, the scrollbar comes from the line count
+            ImGui::BeginChild("##textview", ImVec2(-FLT_MIN, -FLT_MIN), true, ImGuiWindowFlags_HorizontalScrollbar);
+            const char *text = doc.data.get();
+            const float line_height = ImGui::GetTextLineHeight();
+            if (sd->select.pending) {
+                sd->select.pending = false;
+                ImGui::SetScrollY(index.line_for_offset(sd->select.start) * line_height);
+            }
+            ImGuiListClipper clipper;
+            clipper.Begin(index.line_count(), line_height);
+            while (clipper.Step()) {
+                for (int line = clipper.DisplayStart; line < clipper.DisplayEnd; ++line) {
+                    const uint32_t start = index.line_starts[line];
+                    uint32_t end = line + 1 < int(index.line_count()) ? index.line_starts[line + 1] - 1 : uint32_t(doc.size);
+                    if (end > start && text[end - 1] == '\r')
+                        --end;
+                    touch_gui_glyphs(text + start, text + end);
+                    ImGui::TextUnformatted(text + start, text + end);
+                }
+            }
+            clipper.End();
+            ImGui::EndChild();
+        } else {
+            if (sd->select.pending)
+                ImGui::SetKeyboardFocusHere();
+            const ImGuiInputTextFlags flags = ImGuiInputTextFlags_CallbackAlways | ImGuiInputTextFlags_CallbackEdit | ImGuiInputTextFlags_CallbackResize;
+            const float editor_height = ImGui::GetContentRegionAvail().y;
+            if (ImGui::InputTextMultiline("##textedit", doc.data.get(), doc.capacity, ImVec2(-FLT_MIN, -FLT_MIN), flags, text_edit_callback, sd.get())) {
+                sd->text_edited(std::min<uint32_t>(sd->edit_start, doc.size), std::min<uint32_t>(sd->edit_end, doc.size));
+                sd->edit_start = UINT32_MAX;
+                sd->edit_end = 0;
+            }
+            touch_text_edit_glyphs(*sd, editor_height);
+        }
+
+        // match positions next to the scrollbar
+        if (!search.query.empty()) {
+            const ImVec2 min = ImGui::GetItemRectMin();
+            const ImVec2 max = ImGui::GetItemRectMax();
+            const float h = (max.y - min.y) / TextSearch::MARKER_BUCKETS;
+            ImDrawList *draw_list = ImGui::GetWindowDrawList();
+            for (int i = 0; i < TextSearch::MARKER_BUCKETS; ++i) {
+                if (search.markers[i]) {
+                    const float y = min.y + i * h;
+                    draw_list->AddRectFilled(ImVec2(max.x - 4, y), ImVec2(max.x, y + std::max(h, 2.0f)), IM_COL32(255, 160, 0, 255));
+                }
+            }
+        }
     }
 
     ImGui::End();
+
+    ImGui::SetNextWindowPos(ImVec2(10, 10), ImGuiCond_FirstUseEver);
+    ImGui::Begin("Scene", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+    ImGui::Text("Scene CPU: %.3f ms", sd->render_cpu_ms);
+    ImGui::Checkbox("Instanced triangles", &sd->inst.enabled);
+    if (sd->inst.enabled) {
+        ImGui::SetNextItemWidth(200);
+        ImGui::SliderInt("Count", &sd->inst.count, 1, SceneData::MAX_INSTANCE_COUNT, "%d", ImGuiSliderFlags_Logarithmic);
+        ImGui::Checkbox("drawIndirect", &sd->inst.indirect);
+        ImGui::SameLine();
+        ImGui::Checkbox("Transforms on CPU", &sd->inst.cpu_transforms);
+        if (sd->inst.cpu_transforms) {
+            ImGui::SameLine();
+            ImGui::Checkbox("Move", &sd->inst.move);
+        }
+        ImGui::SetNextItemWidth(200);
+        ImGui::SliderAngle("Camera yaw", &sd->camera_yaw, -180.0f, 180.0f);
+        ImGui::Checkbox("Frustum culling", &sd->inst.cull);
+        const CullStats &stats(sd->inst.cull_stats);
+        if (sd->inst.cull) {
+            ImGui::Text("Cells: %u tested, %u culled", stats.cells_tested, stats.cells_culled);
+            ImGui::Text("Objects: %u drawn, %u culled, %u sphere tests, %u changed cells", stats.objects_visible,
+                        stats.objects_culled, stats.objects_tested, stats.objects_moved);
+        }
+        ImGui::Text("Cull/update: %.3f ms", stats.ms);
+    }
+    const bool benchmark_running = sd->transform_benchmark.running || sd->job_benchmark.running;
+    if (sd->transform_benchmark.running)
+        ImGui::TextDisabled("Transform benchmark running...");
+    else if (ImGui::Button("Transform benchmark") && !benchmark_running)
+        sd->run_transform_benchmark();
+    if (sd->transform_benchmark.done && !sd->transform_benchmark.running) {
+        for (int i = 0; i < 4; ++i) {
+            ImGui::Text("%7zu: SIMD %8.3f ms, glm %8.3f ms", sd->transform_benchmark.counts[i],
+                        sd->transform_benchmark.simd_ms[i], sd->transform_benchmark.glm_ms[i]);
+        }
+        const float max_error = sd->transform_benchmark.max_error;
+        if (max_error <= TRANSFORM_MAX_ERROR)
+            ImGui::Text("Max error against glm: %g", max_error);
+        else
+            ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "Max error against glm: %g, above %g", max_error, TRANSFORM_MAX_ERROR);
+    }
+    uint32_t jobs_run = 0, jobs_stolen = 0;
+    for (const auto &q : d.jobs.queues) {
+        jobs_run += q->run.load(std::memory_order_relaxed);
+        jobs_stolen += q->stolen.load(std::memory_order_relaxed);
+    }
+    ImGui::Text("Jobs: %u thread(s), %u run, %u stolen", d.jobs.thread_count(), jobs_run, jobs_stolen);
+    if (sd->job_benchmark.running)
+        ImGui::TextDisabled("Job benchmark running...");
+    else if (ImGui::Button("Job benchmark") && !benchmark_running)
+        sd->run_job_benchmark();
+    if (sd->job_benchmark.done && !sd->job_benchmark.running) {
+        const auto &b(sd->job_benchmark);
+        for (int i = 0; i < SceneData::JOB_BENCHMARK_RUNS; ++i) {
+            ImGui::Text("%2u: transforms %8.3f ms (%.2fx), decode %8.3f ms (%.2fx)", b.threads[i],
+                        b.transform_ms[i], b.transform_ms[0] / b.transform_ms[i], b.decode_ms[i], b.decode_ms[0] / b.decode_ms[i]);
+        }
+    }
+    const auto &cache_stats(d.pipeline_cache_stats);
+    ImGui::Text("Shader modules: %u hits, %u misses, %.3f ms", cache_stats.shader_hits, cache_stats.shader_misses, cache_stats.shader_ms);
+    ImGui::Text("Pipelines: %u hits, %u misses, %.3f ms", cache_stats.pipeline_hits, cache_stats.pipeline_misses, cache_stats.pipeline_ms);
+    ImGui::Text("Async pipelines: %u pending, %.3f ms total", cache_stats.pipelines_pending, cache_stats.pipeline_async_ms);
+    auto &dr(d.dynamic_resolution);
+    ImGui::Checkbox("Dynamic resolution", &dr.enabled);
+    if (dr.enabled) {
+        ImGui::SliderFloat("Target frame time (ms)", &dr.target_ms, 4.0f, 50.0f, "%.1f");
+        ImGui::Text("Scale %.2f, rendering %ux%u of %ux%u, %.2f ms per frame", dr.scale, d.render_size.width, d.render_size.height,
+                    d.fb_size.width, d.fb_size.height, dr.avg_frame_ms);
+    }
+    const CompletionStats &completion_stats(d.completion_stats);
+    ImGui::Text("Completions: %u last frame (max %u) in %.3f ms (max %.3f), %u carried over, %u overflowed",
+                completion_stats.last_frame_run, completion_stats.max_frame_run, completion_stats.last_drain_ms,
+                completion_stats.max_drain_ms, completion_stats.carried_over, completion_stats.overflows);
+    ImGui::SliderFloat("Completion budget (ms)", &d.completion_budget_ms, 0.25f, 8.0f, "%.2f");
+    const auto &attachment_stats(d.attachment_stats);
+    ImGui::Text("Attachments: %u allocated (%.1f MB in total), %.1f MB pooled, %s", attachment_stats.allocations,
+                attachment_stats.allocated_bytes / (1024.0 * 1024.0), attachment_stats.pooled_bytes / (1024.0 * 1024.0),
+                d.color_target_view ? "offscreen" : "direct");
+    if (ImGui::TreeNode("GPU heaps")) {
+        static const char *kind_names[] = { "Vertex", "Index", "Uniform", "Storage" };
+        for (int kind = 0; kind < int(GpuHeapKind::Count); ++kind) {
+            const GpuHeap &heap(d.gpu_heaps[kind]);
+            const GpuHeapStats stats = gpu_heap_stats(GpuHeapKind(kind));
+            // share of the free space that is not in the largest free range
+            const double fragmentation = stats.free_bytes ? 1.0 - double(stats.largest_free_range) / stats.free_bytes : 0.0;
+            ImGui::Text("%-8s %u allocs, %.1f of %.1f KB used, %u free ranges, %.0f%% fragmented, %u dedicated (%.1f KB)",
+                        kind_names[kind], heap.allocation_count, heap.allocated_bytes / 1024.0, stats.block_bytes / 1024.0,
+                        stats.free_range_count, fragmentation * 100.0, heap.dedicated_count, heap.dedicated_bytes / 1024.0);
+        }
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Heap")) {
+        const FrameArena &arena(d.frame_arena);
+        size_t arena_bytes = 0;
+        for (const FrameArena::Chunk &c : arena.chunks)
+            arena_bytes += c.size;
+        ImGui::Text("Frame arena: %.1f KB last frame, %.1f KB peak, %zu chunk(s), %.1f KB",
+                    arena.frame_bytes / 1024.0, arena.peak_frame_bytes / 1024.0, arena.chunks.size(), arena_bytes / 1024.0);
+        const struct mallinfo mi = mallinfo();
+        // free bytes inside the heap are holes between allocations (or the top of the heap)
+        ImGui::Text("malloc: %.2f MB in use, %.2f MB free in %.2f MB heap, %d free chunks", mi.uordblks / (1024.0 * 1024.0),
+                    mi.fordblks / (1024.0 * 1024.0), mi.arena / (1024.0 * 1024.0), mi.ordblks);
+        const HeapStats &h(d.heap_stats);
+        const int n = std::min(h.sample_count, HEAP_SAMPLE_COUNT);
+        const int first = h.sample_count > HEAP_SAMPLE_COUNT ? h.sample_count % HEAP_SAMPLE_COUNT : 0;
+        ImGui::PlotLines("In use (MB)", h.in_use_mb, n, first, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+        ImGui::PlotLines("Free (MB)", h.free_mb, n, first, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+        ImGui::TextDisabled("one sample per minute, last 8 hours");
+        ImGui::TreePop();
+    }
+    ImGui::Text("Deferred releases: %zu pending, GPU %u frame(s) behind", d.deferred_releases.size(), d.frame_count - d.completed_frame);
+    if (ImGui::TreeNode("Input")) {
+        const InputStats &in(d.input_stats);
+        ImGui::Text("Events: %u received, %u merged while the ring was full, %u given to ImGui; last frame %u -> %u",
+                    d.input_ring.pushed.load(std::memory_order_relaxed), d.input_ring.merged.load(std::memory_order_relaxed),
+                    in.applied, in.last_frame_raw, in.last_frame_applied);
+        const int n = std::min(in.sample_count, INPUT_LATENCY_SAMPLE_COUNT);
+        const int first = in.sample_count > INPUT_LATENCY_SAMPLE_COUNT ? in.sample_count % INPUT_LATENCY_SAMPLE_COUNT : 0;
+        if (n) {
+            float submit_avg = 0.0f, submit_max = 0.0f, done_avg = 0.0f, done_max = 0.0f;
+            for (int i = 0; i < n; ++i) {
+                submit_avg += in.submit_ms[i] / n;
+                submit_max = std::max(submit_max, in.submit_ms[i]);
+                done_avg += in.gpu_done_ms[i] / n;
+                done_max = std::max(done_max, in.gpu_done_ms[i]);
+            }
+            ImGui::Text("Input to submit: %.2f ms avg, %.2f ms max", submit_avg, submit_max);
+            ImGui::Text("Input to GPU done: %.2f ms avg, %.2f ms max", done_avg, done_max);
+            ImGui::PlotLines("To GPU done (ms)", in.gpu_done_ms, n, first, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+            ImGui::TextDisabled("last %d frames with input, presenting adds up to a refresh", n);
+        }
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Startup timeline")) {
+        double prev_ms = 0.0;
+        for (const StartupMilestone &m : d.startup_timeline) {
+            ImGui::Text("%8.1f ms (+%7.1f) %s", m.ms, m.ms - prev_ms, m.name);
+            prev_ms = m.ms;
+        }
+        ImGui::TreePop();
+    }
+    if (ImGui::Button("Encode benchmark"))
+        sd->encode_benchmark.requested = true;
+    if (sd->encode_benchmark.done) {
+        ImGui::Text("%d draws", SceneData::BENCHMARK_DRAW_COUNT);
+        ImGui::Text("Direct encode: %.3f ms", sd->encode_benchmark.direct_ms);
+        ImGui::Text("Bundle record: %.3f ms", sd->encode_benchmark.record_ms);
+        ImGui::Text("Bundle replay: %.3f ms", sd->encode_benchmark.replay_ms);
+    }
+    ImGui::End();
+
+    if (sd->show_gpu_memory) {
+        GpuMemoryTracker &t(d.gpu_memory);
+        ImGui::Begin("GPU memory", &sd->show_gpu_memory);
+        if (ImGui::BeginTable("gpu_memory", 4)) {
+            ImGui::TableSetupColumn("Category");
+            ImGui::TableSetupColumn("Objects");
+            ImGui::TableSetupColumn("MB");
+            ImGui::TableSetupColumn("Peak MB");
+            ImGui::TableHeadersRow();
+            for (int i = 0; i < int(GpuMemoryCategory::Count); ++i) {
+                const GpuMemoryTracker::Category &c(t.categories[i]);
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(gpu_memory_category_names[i]);
+                ImGui::TableNextColumn();
+                ImGui::Text("%u", c.count);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.2f", c.bytes / (1024.0 * 1024.0));
+                ImGui::TableNextColumn();
+                ImGui::Text("%.2f", c.peak_bytes / (1024.0 * 1024.0));
+            }
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted("Total");
+            ImGui::TableNextColumn();
+            ImGui::Text("%zu", t.objects.size());
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f", t.total_bytes / (1024.0 * 1024.0));
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f", t.peak_bytes / (1024.0 * 1024.0));
+            ImGui::EndTable();
+        }
+        ImGui::SliderFloat("Budget (MB)", &t.budget_mb, 1.0f, 1024.0f, "%.0f", ImGuiSliderFlags_Logarithmic);
+        ImGui::Text("%u evictions, image halved %d time(s)", t.eviction_count, sd->image.downscale);
+        ImGui::TextDisabled("Swapchain textures are not included");
+        ImGui::End();
+    }
+
+    if (sd->image.show && sd->image.view) {
+        ImGui::SetNextWindowSize(ImVec2(400, 300), ImGuiCond_FirstUseEver);
+        ImGui::Begin("Images", &sd->image.show);
+        // text and thumbnails interleaved, exercises switching between the two GUI pipelines
+        const ImTextureID id = ImTextureID(sd->image.view);
+        for (int i = 0; i < 32; ++i) {
+            ImGui::Image(id, ImVec2(48, 48), ImVec2((i % 4) * 0.25f, (i / 4 % 4) * 0.25f), ImVec2((i % 4 + 1) * 0.25f, (i / 4 % 4 + 1) * 0.25f));
+            if (ImGui::IsItemHovered())
+                ImGui::SetTooltip("tile %d", i);
+            if (i % 6 != 5)
+                ImGui::SameLine();
+        }
+        ImGui::NewLine();
+        ImGui::Image(id, ImVec2(256, 256));
+        ImGui::End();
+    }
 }
 
 void Scene::render()
@@ -1667,23 +6353,40 @@ void Scene::render()
         sd->projection_matrix = glm::perspective(45.0f, float(d.fb_size.width) / d.fb_size.height, 0.01f, 1000.0f);
     }
 
+    const double t0 = emscripten_get_now();
+
     glm::mat4 model_matrix = glm::rotate(glm::identity<glm::mat4>(), glm::radians(sd->tri.rotation), glm::vec3(0.0f, 1.0f, 0.0f));
+    sd->view_matrix = glm::rotate(glm::translate(glm::identity<glm::mat4>(), glm::vec3(0.0f, 0.0f, -4.0f)), sd->camera_yaw, glm::vec3(0.0f, 1.0f, 0.0f));
     glm::mat4 view_projection_matrix = sd->projection_matrix * sd->view_matrix;
     glm::mat4 mvp = view_projection_matrix * model_matrix;
 
     UBufStagingArea u = next_ubuf_staging_area_for_current_frame();
     memcpy(u.p, &mvp[0], 64);
-    enqueue_ubuf_staging_copy(u, sd->tri.ubuf, 64);
+    enqueue_ubuf_staging_copy(u, sd->tri.ubuf->buffer, 64, 0, sd->tri.ubuf->offset);
 
     sd->tri.rotation += 1.0f;
 
     WGPUColor clear_color = { 0.0f, 1.0f, 0.0f, 1.0f };
     WGPURenderPassEncoder pass = begin_render_pass(clear_color);
 
-    wgpuRenderPassEncoderSetPipeline(pass, sd->tri.ps);
-    wgpuRenderPassEncoderSetBindGroup(pass, 0, sd->tri.bg, 0, nullptr);
-    wgpuRenderPassEncoderSetVertexBuffer(pass, 0, sd->tri.vbuf, 0, sd->tri.vbuf_size);
-    wgpuRenderPassEncoderDraw(pass, 3, 1, 0, 0);
+    // pipelines still compiling are skipped until ready
+    if (sd->tri.ps) {
+        // the rotation only changes the contents of ubuf, the draws themselves are static
+        SceneData *s = sd.get();
+        execute_static_draws(pass, &sd->tri.draws, { sd->tri.ps, sd->tri.bg, sd->tri.vbuf }, [s](WGPURenderBundleEncoder encoder) {
+            wgpuRenderBundleEncoderSetPipeline(encoder, s->tri.ps);
+            wgpuRenderBundleEncoderSetBindGroup(encoder, 0, s->tri.bg, 0, nullptr);
+            wgpuRenderBundleEncoderSetVertexBuffer(encoder, 0, s->tri.vbuf->buffer, s->tri.vbuf->offset, s->tri.vbuf_size);
+            wgpuRenderBundleEncoderDraw(encoder, 3, 1, 0, 0);
+        });
+
+        if (sd->encode_benchmark.requested)
+            sd->run_encode_benchmark();
+    }
+
+    if (sd->inst.enabled && (sd->inst.cpu_transforms ? sd->inst.mvp_ps : sd->inst.ps))
+        sd->render_instances(pass, view_projection_matrix);
+    sd->render_cpu_ms = emscripten_get_now() - t0;
 
     render_gui(pass);
 